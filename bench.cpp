@@ -0,0 +1,405 @@
+// Benchmarks of separate operations of Expression on generated corpora.
+// Usage: expression-bench [formulas per corpus]
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Every allocation of the process goes through these, so allocations of each
+// operation are counted without instrumenting the library
+static std::atomic <size_t> g_allocations(0);
+
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	void *res = std::malloc(size == 0 ? 1 : size);
+	if(res == nullptr) {
+		throw std::bad_alloc();
+	}
+	return res;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+// Hardware counters of the calling thread. If perf_event_open isn't available (other
+// platforms, containers, perf_event_paranoid) counters are just not reported.
+class PerfCounters
+{
+public:
+	static const size_t count = 4;
+
+	PerfCounters()
+	{
+		for(size_t i = 0; i < count; ++i) {
+			m_fd[i] = -1;
+			m_values[i] = 0;
+		}
+#ifdef __linux__
+		const uint64_t configs[count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		                                 PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+		for(size_t i = 0; i < count; ++i) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			m_fd[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+#endif
+	}
+	~PerfCounters()
+	{
+#ifdef __linux__
+		for(size_t i = 0; i < count; ++i) {
+			if(m_fd[i] >= 0) {
+				close(m_fd[i]);
+			}
+		}
+#endif
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	static const char* name(size_t i)
+	{
+		static const char *names[count] = {"cycles", "instr", "cache-miss", "branch-miss"};
+		return names[i];
+	}
+	bool available(size_t i) const
+	{
+		return m_fd[i] >= 0;
+	}
+	void start()
+	{
+#ifdef __linux__
+		for(size_t i = 0; i < count; ++i) {
+			if(m_fd[i] >= 0) {
+				ioctl(m_fd[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(m_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+	void stop()
+	{
+#ifdef __linux__
+		for(size_t i = 0; i < count; ++i) {
+			m_values[i] = 0;
+			if(m_fd[i] >= 0) {
+				ioctl(m_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+				if(read(m_fd[i], &m_values[i], sizeof(m_values[i])) != sizeof(m_values[i])) {
+					m_values[i] = 0;
+				}
+			}
+		}
+#endif
+	}
+	uint64_t value(size_t i) const
+	{
+		return m_values[i];
+	}
+private:
+	int m_fd[count];
+	uint64_t m_values[count];
+};
+
+// Measures time, allocations and hardware counters of a block of code
+class Measurement
+{
+public:
+	Measurement(PerfCounters &counters) :
+		m_counters(counters)
+	{
+	}
+
+	template <typename F>
+	void run(const char *name, size_t ops, F f)
+	{
+		size_t allocations = g_allocations.load();
+		m_counters.start();
+		auto begin = std::chrono::steady_clock::now();
+		f();
+		auto end = std::chrono::steady_clock::now();
+		m_counters.stop();
+		allocations = g_allocations.load() - allocations;
+
+		double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+		std::printf("  %-16s %12.1f ns/op %10.2f allocs/op", name, ns / ops,
+		            static_cast<double>(allocations) / ops);
+		for(size_t i = 0; i < PerfCounters::count; ++i) {
+			if(m_counters.available(i)) {
+				std::printf(" %10.1f %s/op", static_cast<double>(m_counters.value(i)) / ops,
+				            PerfCounters::name(i));
+			}
+		}
+		std::printf("\n");
+	}
+private:
+	PerfCounters &m_counters;
+};
+
+struct Corpus
+{
+	enum class Mix {ARITH, BUILTIN, CALLS, PARENS};
+
+	const char *name;
+	Mix mix;
+	// Maximal depth of each term (nesting depth for PARENS)
+	size_t depth;
+	// Number of terms summed at the top level
+	size_t width;
+	// Number of distinct variables
+	size_t vars;
+};
+
+class Generator
+{
+public:
+	Generator(const Corpus &corpus, unsigned seed) :
+		m_corpus(corpus), m_rng(seed)
+	{
+	}
+
+	// Returns the formula, term is set to one of its top-level terms
+	std::string formula(std::string &term)
+	{
+		if(m_corpus.mix == Corpus::Mix::PARENS) {
+			term = variable();
+			return std::string(m_corpus.depth, '(') + term + std::string(m_corpus.depth, ')');
+		}
+		std::string res;
+		size_t pick = m_rng() % m_corpus.width;
+		for(size_t i = 0; i < m_corpus.width; ++i) {
+			std::string t = generate(m_corpus.depth);
+			if(i == pick) {
+				term = t;
+			}
+			res += (i == 0) ? t : " + " + t;
+		}
+		return res;
+	}
+private:
+	std::string variable()
+	{
+		return "v" + std::to_string(m_rng() % m_corpus.vars);
+	}
+
+	std::string leaf()
+	{
+		return (m_rng() % 3 == 0) ? std::to_string(m_rng() % 100) : variable();
+	}
+
+	std::string generate(size_t depth)
+	{
+		if((depth == 0) || ((depth < m_corpus.depth) && (m_rng() % 5 == 0))) {
+			return leaf();
+		}
+		size_t kinds = 4;
+		if(m_corpus.mix == Corpus::Mix::BUILTIN) {
+			kinds = 8;
+		} else if(m_corpus.mix == Corpus::Mix::CALLS) {
+			kinds = 11;
+		}
+		switch(m_rng() % kinds) {
+		case 0:
+			return "(" + generate(depth - 1) + " + " + generate(depth - 1) + ")";
+		case 1:
+			return "(" + generate(depth - 1) + " - " + generate(depth - 1) + ")";
+		case 2:
+			return generate(depth - 1) + " * " + generate(depth - 1);
+		case 3:
+			// Divisor is never zero
+			return generate(depth - 1) + " / " + std::to_string(m_rng() % 9 + 1);
+		case 4:
+			return "-" + generate(depth - 1);
+		case 5:
+			return "abs(" + generate(depth - 1) + ")";
+		case 6:
+			return "min(" + generate(depth - 1) + ", " + generate(depth - 1) + ")";
+		case 7:
+			return "max(" + generate(depth - 1) + ", " + generate(depth - 1) + ")";
+		case 8:
+			return "sin(" + generate(depth - 1) + ")";
+		case 9:
+			return "cosh(" + generate(depth - 1) + ")";
+		default:
+			return "atan2(" + generate(depth - 1) + ", " + generate(depth - 1) + ")";
+		}
+	}
+
+	const Corpus &m_corpus;
+	std::mt19937 m_rng;
+};
+
+void runCorpus(const Corpus &corpus, size_t n, Measurement &m)
+{
+	std::vector <std::string> formulas, terms;
+	Generator g(corpus, 12345);
+	size_t length = 0;
+	for(size_t i = 0; i < n; ++i) {
+		std::string term;
+		formulas.push_back(g.formula(term));
+		terms.push_back(term);
+		length += formulas.back().size();
+	}
+	std::printf("%s: %zu formulas, %.0f chars on average\n", corpus.name, n,
+	            static_cast<double>(length) / n);
+
+	std::vector <std::unique_ptr <Expression> > exprs, copies, subs;
+	exprs.reserve(n);
+	copies.reserve(n);
+	subs.reserve(n);
+	for(size_t i = 0; i < n; ++i) {
+		subs.emplace_back(new Expression(terms[i]));
+	}
+
+	m.run("parse", n, [&]() {
+		for(size_t i = 0; i < n; ++i) {
+			exprs.emplace_back(new Expression(formulas[i]));
+		}
+	});
+	m.run("copy", n, [&]() {
+		for(size_t i = 0; i < n; ++i) {
+			copies.emplace_back(new Expression(*exprs[i]));
+		}
+	});
+	size_t equal = 0;
+	m.run("operator==", n, [&]() {
+		for(size_t i = 0; i < n; ++i) {
+			equal += (*exprs[i] == *copies[i]);
+		}
+	});
+	size_t found = 0;
+	m.run("isSub (first)", n, [&]() {
+		for(size_t i = 0; i < n; ++i) {
+			found += exprs[i]->isSubExpression(*subs[i]);
+		}
+	});
+	m.run("isSub (indexed)", n, [&]() {
+		for(size_t i = 0; i < n; ++i) {
+			found += exprs[i]->isSubExpression(*subs[i]);
+		}
+	});
+
+	const size_t reps = 16;
+	std::vector <int> values(corpus.vars + 1);
+	for(size_t i = 0; i < values.size(); ++i) {
+		values[i] = static_cast<int>(i % 7) + 1;
+	}
+	int sum = 0;
+	m.run("eval", n * reps, [&]() {
+		for(size_t r = 0; r < reps; ++r) {
+			for(size_t i = 0; i < n; ++i) {
+				// Ids of variables of different formulas differ, but values only have to be valid
+				sum += exprs[i]->eval(values.data());
+			}
+		}
+	});
+	m.run("destroy", n, [&]() {
+		exprs.clear();
+	});
+	// Keeps results alive, so that the compiler can't drop the work
+	if((equal != n) || (found != 2 * n) || (sum == 42)) {
+		std::printf("  (equal %zu, found %zu, sum %d)\n", equal, found, sum);
+	}
+}
+
+// Expressions built by repeated doubling z = z + z are DAGs with 2^k paths to their leaves,
+// every operation on them has to stay linear in the number of cells
+void runDoubling(size_t k, Measurement &m)
+{
+	std::printf("doubling: %zu steps\n", k);
+	std::vector <std::unique_ptr <Expression> > exprs;
+	m.run("compose", 2, [&]() {
+		for(size_t i = 0; i < 2; ++i) {
+			std::unique_ptr <Expression> z(new Expression("x * y + 1"));
+			for(size_t j = 0; j < k; ++j) {
+				*z = std::move(*z) + *z;
+			}
+			exprs.push_back(std::move(z));
+		}
+	});
+	Expression sub("x * y + 1 + (x * y + 1)");
+	bool equal = false, found = false;
+	m.run("operator==", 1, [&]() {
+		equal = (*exprs[0] == *exprs[1]);
+	});
+	m.run("isSub (first)", 1, [&]() {
+		found = exprs[0]->isSubExpression(sub);
+	});
+	int sum = 0;
+	m.run("eval", 1, [&]() {
+		sum = exprs[0]->eval();
+	});
+	m.run("simplify", 1, [&]() {
+		exprs[1]->simplify();
+	});
+	if(!equal || !found || (sum == 42)) {
+		std::printf("  (equal %d, found %d, sum %d)\n", equal, found, sum);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 200;
+	if(n == 0) {
+		std::cerr << "Usage: " << argv[0] << " [formulas per corpus]" << std::endl;
+		return 1;
+	}
+	const Corpus corpora[] = {
+		{"shallow-wide", Corpus::Mix::ARITH, 3, 64, 8},
+		{"deep-narrow", Corpus::Mix::ARITH, 12, 1, 4},
+		{"builtin-mix", Corpus::Mix::BUILTIN, 6, 8, 16},
+		{"calls-mix", Corpus::Mix::CALLS, 6, 8, 16},
+		{"many-vars", Corpus::Mix::ARITH, 4, 16, 256},
+		{"nested-parens", Corpus::Mix::PARENS, 2000, 1, 1},
+	};
+
+	PerfCounters counters;
+	Measurement m(counters);
+	try {
+		for(const auto &corpus : corpora) {
+			runCorpus(corpus, n, m);
+		}
+		runDoubling(40, m);
+	} catch(std::exception &e) {
+		std::cout << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -1,116 +1,697 @@
 #include "expression.hpp"
 
 #include <algorithm>
-#include <iostream>
 #include <cmath>
+#include <cstring>
+#include <type_traits>
 
 #define DEFINE_OPERATOR(op)						\
-	Expression& Expression::operator op## =	(const Expression &e)	\
+	template <typename T>						\
+	BasicExpression<T>& BasicExpression<T>::operator op## =	(const BasicExpression &e)	\
 	{											\
-		addFunction(findFunction(#op, Function<int>::Type::INFIX), e); \
+		addFunction(findFunction(#op, Function<T>::Type::INFIX), e); \
 		return *this;							\
 	}											\
 
 #define DEFINE_OPERATORV(op)					\
-	Expression Expression::operator op(const Expression &e) const	\
+	template <typename T>						\
+	BasicExpression<T> BasicExpression<T>::operator op(const BasicExpression &e) const &	\
 	{											\
-		Expression	res(*this);					\
+		BasicExpression	res(*this);				\
 		res op## = e;							\
 		return res;								\
+	}											\
+	template <typename T>						\
+	BasicExpression<T> BasicExpression<T>::operator op(const BasicExpression &e) &&	\
+	{											\
+		*this op## = e;							\
+		return std::move(*this);				\
 	}
 
-using std::cout;
-using std::endl;
-
 namespace {
-const Functions<int> operators = {
-	Function<int>("+", 10, [](const Args<int> &a){return a[0] + a[1];}, true),
-	Function<int>("-", 10, [](const Args<int> &a){return a[0] - a[1];}, false),
-	Function<int>("*", 20, [](const Args<int> &a){return a[0] * a[1];}, true),
-	Function<int>("/", 20, [](const Args<int> &a){return a[0] / a[1];}, false),
-	Function<int>("-", 40, [](const Args<int> &a){return -a[0];}, Function<int>::Type::PREFIX)};
-const Functions<int> functions = {
-	Function<int>("abs", [](const Args<int> &a){return std::abs(a[0]);}),
-	Function<int>("ceil", [](const Args<int> &a){return ceil(a[0]);}),
-	Function<int>("floor", [](const Args<int> &a){return floor(a[0]);}),
-	Function<int>("max", [](const Args<int> &a){return std::max(a[0], a[1]);}, 2),
-	Function<int>("min", [](const Args<int> &a){return std::min(a[0], a[1]);}, 2),
-
-	Function<int>("sin", [](const Args<int> &a){return sin(a[0]);}),
-	Function<int>("cos", [](const Args<int> &a){return cos(a[0]);}),
-	Function<int>("tan", [](const Args<int> &a){return tan(a[0]);}),
-	Function<int>("ctg", [](const Args<int> &a){return 1.0 / tan(a[0]);}),
-	Function<int>("asin", [](const Args<int> &a){return asin(a[0]);}),
-	Function<int>("acos", [](const Args<int> &a){return acos(a[0]);}),
-	Function<int>("atan", [](const Args<int> &a){return atan(a[0]);}),
-	Function<int>("atan2", [](const Args<int> &a){return atan2(a[0], a[1]);}, 2),
-
-	Function<int>("cosh", [](const Args<int> &a){return cosh(a[0]);}),
-	Function<int>("sinh", [](const Args<int> &a){return sinh(a[0]);}),
-	Function<int>("tanh", [](const Args<int> &a){return tanh(a[0]);}),
-	Function<int>("ctgh", [](const Args<int> &a){return 1.0 / (a[0]);}),
-	Function<int>("acosh", [](const Args<int> &a){return acosh(a[0]);}),
-	Function<int>("asinh", [](const Args<int> &a){return asinh(a[0]);}),
-	Function<int>("atanh", [](const Args<int> &a){return atanh(a[0]);}),
-	Function<int>("actgh", [](const Args<int> &a){return atanh(1.0 /a[0]);})};
-}
-
-Expression::Expression(const std::string &s) :
-	m_root(nullptr)
-{
-	ExpressionParserSettings <int> set(operators, functions, m_varnames);
+// Implementations of the default grammar. They are plain functions of fixed arity, so
+// compiled expressions call them directly.
+template <typename T> T add(T a, T b) {return a + b;}
+template <typename T> T sub(T a, T b) {return a - b;}
+template <typename T> T mul(T a, T b) {return a * b;}
+template <typename T> T div(T a, T b) {return a / b;}
+template <typename T> T neg(T a) {return -a;}
+template <typename T> T abs(T a) {return std::abs(a);}
+template <typename T> T ceil(T a) {return std::ceil(a);}
+template <typename T> T floor(T a) {return std::floor(a);}
+template <typename T> T max(T a, T b) {return std::max(a, b);}
+template <typename T> T min(T a, T b) {return std::min(a, b);}
+
+template <typename T> T sin(T a) {return std::sin(a);}
+template <typename T> T cos(T a) {return std::cos(a);}
+template <typename T> T tan(T a) {return std::tan(a);}
+template <typename T> T ctg(T a) {return 1.0 / std::tan(a);}
+template <typename T> T asin(T a) {return std::asin(a);}
+template <typename T> T acos(T a) {return std::acos(a);}
+template <typename T> T atan(T a) {return std::atan(a);}
+template <typename T> T atan2(T a, T b) {return std::atan2(a, b);}
+
+template <typename T> T cosh(T a) {return std::cosh(a);}
+template <typename T> T sinh(T a) {return std::sinh(a);}
+template <typename T> T tanh(T a) {return std::tanh(a);}
+template <typename T> T ctgh(T a) {return 1.0 / std::tanh(a);}
+template <typename T> T acosh(T a) {return std::acosh(a);}
+template <typename T> T asinh(T a) {return std::asinh(a);}
+template <typename T> T atanh(T a) {return std::atanh(a);}
+template <typename T> T actgh(T a) {return std::atanh(1.0 / a);}
+
+// Derivative rules of the functions above (see Function::Derivative)
+template <typename T> void dstep(const Args <T>&, T, Args <T> &d) {d[0] = 0;}
+template <typename T> void dsin(const Args <T> &a, T, Args <T> &d) {d[0] = std::cos(a[0]);}
+template <typename T> void dcos(const Args <T> &a, T, Args <T> &d) {d[0] = -std::sin(a[0]);}
+template <typename T> void dtan(const Args <T>&, T r, Args <T> &d) {d[0] = 1 + r * r;}
+template <typename T> void dctg(const Args <T>&, T r, Args <T> &d) {d[0] = -1 - r * r;}
+template <typename T> void dasin(const Args <T> &a, T, Args <T> &d) {d[0] = 1.0 / std::sqrt(1 - a[0] * a[0]);}
+template <typename T> void dacos(const Args <T> &a, T, Args <T> &d) {d[0] = -1.0 / std::sqrt(1 - a[0] * a[0]);}
+template <typename T> void datan(const Args <T> &a, T, Args <T> &d) {d[0] = 1.0 / (1 + a[0] * a[0]);}
+template <typename T> void datan2(const Args <T> &a, T, Args <T> &d)
+{
+	T r = a[0] * a[0] + a[1] * a[1];
+	d[0] = a[1] / r;
+	d[1] = -a[0] / r;
+}
+
+template <typename T> void dcosh(const Args <T> &a, T, Args <T> &d) {d[0] = std::sinh(a[0]);}
+template <typename T> void dsinh(const Args <T> &a, T, Args <T> &d) {d[0] = std::cosh(a[0]);}
+// Same for tanh and ctgh
+template <typename T> void dtanh(const Args <T>&, T r, Args <T> &d) {d[0] = 1 - r * r;}
+template <typename T> void dacosh(const Args <T> &a, T, Args <T> &d) {d[0] = 1.0 / std::sqrt(a[0] * a[0] - 1);}
+template <typename T> void dasinh(const Args <T> &a, T, Args <T> &d) {d[0] = 1.0 / std::sqrt(a[0] * a[0] + 1);}
+// Same for atanh and actgh
+template <typename T> void datanh(const Args <T> &a, T, Args <T> &d) {d[0] = 1.0 / (1 - a[0] * a[0]);}
+
+template <typename T>
+ExpressionParserSettings <T> makeDefaultSettings()
+{
+	Functions<T> operators = {
+		Function<T>(Function<T>("+", 10, &add<T>, true), Function<T>::Builtin::ADD),
+		Function<T>(Function<T>("-", 10, &sub<T>, false), Function<T>::Builtin::SUB),
+		Function<T>(Function<T>("*", 20, &mul<T>, true), Function<T>::Builtin::MUL),
+		Function<T>(Function<T>("/", 20, &div<T>, false), Function<T>::Builtin::DIV),
+		Function<T>(Function<T>("-", 40, &neg<T>, Function<T>::Type::PREFIX), Function<T>::Builtin::NEG)};
+	Functions<T> functions = {
+		Function<T>(Function<T>("abs", &abs<T>), Function<T>::Builtin::ABS),
+		Function<T>(Function<T>("ceil", &ceil<T>), &dstep<T>),
+		Function<T>(Function<T>("floor", &floor<T>), &dstep<T>),
+		Function<T>(Function<T>("max", &max<T>), Function<T>::Builtin::MAX),
+		Function<T>(Function<T>("min", &min<T>), Function<T>::Builtin::MIN),
+
+		Function<T>(Function<T>("sin", &sin<T>), &dsin<T>),
+		Function<T>(Function<T>("cos", &cos<T>), &dcos<T>),
+		Function<T>(Function<T>("tan", &tan<T>), &dtan<T>),
+		Function<T>(Function<T>("ctg", &ctg<T>), &dctg<T>),
+		Function<T>(Function<T>("asin", &asin<T>), &dasin<T>),
+		Function<T>(Function<T>("acos", &acos<T>), &dacos<T>),
+		Function<T>(Function<T>("atan", &atan<T>), &datan<T>),
+		Function<T>(Function<T>("atan2", &atan2<T>), &datan2<T>),
+
+		Function<T>(Function<T>("cosh", &cosh<T>), &dcosh<T>),
+		Function<T>(Function<T>("sinh", &sinh<T>), &dsinh<T>),
+		Function<T>(Function<T>("tanh", &tanh<T>), &dtanh<T>),
+		Function<T>(Function<T>("ctgh", &ctgh<T>), &dtanh<T>),
+		Function<T>(Function<T>("acosh", &acosh<T>), &dacosh<T>),
+		Function<T>(Function<T>("asinh", &asinh<T>), &dasinh<T>),
+		Function<T>(Function<T>("atanh", &atanh<T>), &datanh<T>),
+		Function<T>(Function<T>("actgh", &actgh<T>), &datanh<T>)};
+	// None of them throws, so native code may call them directly
+	for(auto &i : operators) {
+		i.nothrow = true;
+	}
+	for(auto &i : functions) {
+		i.nothrow = true;
+	}
+
+	ExpressionParserSettings <T> set(operators, functions);
+	// Regexes aren't used by the built-in lexer, but they are kept here so that
+	// a copy of this grammar can be switched to regex mode.
 	set.regex_whitespace = std::regex("^[[:space:]]+");
-	set.regex_constant = std::regex("^[[:digit:]]+");
+	if(std::is_floating_point<T>::value) {
+		set.regex_constant = std::regex("^[[:digit:]]+(\\.[[:digit:]]*)?([eE][+-]?[[:digit:]]+)?");
+	} else {
+		set.regex_constant = std::regex("^[[:digit:]]+");
+	}
 	set.regex_parenthesis_begin = std::regex("^\\(");
 	set.regex_parenthesis_end = std::regex("^\\)");
 	set.regex_variable = std::regex("^[[:alpha:]][[:alnum:]]*");
 	set.regex_function_begin = std::regex("^[[:alpha:]][[:alnum:]]*[[:space:]]*\\(");
 	set.regex_function_end = std::regex("^\\)");
 	set.regex_func_args_separator = std::regex("^,");
-	ExpressionParser <int> p(set, s);
-	m_root = p.parse();
+	return set;
+}
+}
+
+template <typename T>
+const ExpressionParserSettings <T>& BasicExpression<T>::defaultSettings()
+{
+	// Initialization of function-local statics is thread-safe since C++11
+	static const ExpressionParserSettings <T> settings = makeDefaultSettings<T>();
+	return settings;
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(const std::string &s) :
+	m_settings(&defaultSettings()),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+	ParserInput input(s);
+	parse(input);
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(const std::string &s, const ExpressionParserSettings <T> &settings) :
+	m_settings(&settings),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+	ParserInput input(s);
+	parse(input);
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(ParserInput &input) :
+	m_settings(&defaultSettings()),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+	parse(input);
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(ParserInput &input, const ExpressionParserSettings <T> &settings) :
+	m_settings(&settings),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+	parse(input);
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(ParserInput &input, const ExpressionParserSettings <T> &settings,
+                                    ExpressionParserError *error, typename ExpressionParser<T>::Scratch *scratch) :
+	m_settings(&settings),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+	parse(input, error, scratch);
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(const ExpressionParserSettings <T> &settings) :
+	m_settings(&settings),
+	m_root(nullptr),
+	m_has_cells(true),
+	m_use_native(false),
+	m_use_incremental(false),
+	m_hash_consed(false),
+	m_dirty(false),
+	m_subtrees_built(false)
+{
+}
+
+template <typename T>
+BasicExpression<T> BasicExpression<T>::tryParse(const std::string &s, ExpressionParserError &error)
+{
+	ParserInput input(s);
+	return BasicExpression(input, defaultSettings(), &error);
+}
+
+template <typename T>
+BasicExpression<T> BasicExpression<T>::tryParse(const std::string &s, const ExpressionParserSettings <T> &settings,
+                                                ExpressionParserError &error)
+{
+	ParserInput input(s);
+	return BasicExpression(input, settings, &error);
+}
+
+template <typename T>
+BasicExpression<T> BasicExpression<T>::tryParse(ParserInput &input, ExpressionParserError &error)
+{
+	return BasicExpression(input, defaultSettings(), &error);
+}
+
+template <typename T>
+BasicExpression<T> BasicExpression<T>::tryParse(ParserInput &input, const ExpressionParserSettings <T> &settings,
+                                                ExpressionParserError &error)
+{
+	return BasicExpression(input, settings, &error);
+}
+
+template <typename T>
+std::vector <std::unique_ptr <BasicExpression<T> > > BasicExpression<T>::parseLines(const char *data, size_t size,
+                                                                                    ThreadPool &pool,
+                                                                                    std::vector <LineError> &errors)
+{
+	return parseLines(data, size, pool, errors, defaultSettings());
+}
+
+template <typename T>
+std::vector <std::unique_ptr <BasicExpression<T> > > BasicExpression<T>::parseLines(const char *data, size_t size,
+                                                                                    ThreadPool &pool,
+                                                                                    std::vector <LineError> &errors,
+                                                                                    const ExpressionParserSettings <T> &settings)
+{
+	// Beginnings of lines followed by the end of the text
+	std::vector <size_t> lines;
+	for(size_t pos = 0; pos < size;) {
+		lines.push_back(pos);
+		const void *next = std::memchr(data + pos, '\n', size - pos);
+		pos = (next == nullptr) ? size : static_cast<const char*>(next) - data + 1;
+	}
+	size_t n = lines.size();
+	lines.push_back(size);
+
+	std::vector <std::unique_ptr <BasicExpression> > res(n);
+	// Several tasks per thread, so that threads that finish early can steal the rest
+	size_t chunk_size = std::max<size_t>(1, n / (pool.size() * 8));
+	size_t chunks = (n + chunk_size - 1) / chunk_size;
+	// Each task collects its errors separately, so tasks share nothing but the results
+	// vector, where each of them writes its own elements
+	std::vector <std::vector <LineError> > chunk_errors(chunks);
+	std::vector <ThreadPool::Task> tasks;
+	for(size_t c = 0; c < chunks; ++c) {
+		tasks.push_back([&, c]() {
+			// Buffers of the parser are allocated once per task and reused for all its lines
+			typename ExpressionParser<T>::Scratch scratch;
+			for(size_t i = c * chunk_size; (i < (c + 1) * chunk_size) && (i < n); ++i) {
+				size_t begin = lines[i], end = lines[i + 1];
+				while((end > begin) && ((data[end - 1] == '\n') || (data[end - 1] == '\r'))) {
+					--end;
+				}
+				if(std::all_of(data + begin, data + end, [](char ch) {return isspace(static_cast<unsigned char>(ch));})) {
+					// Blank line
+					continue;
+				}
+				ParserInput input(data + begin, end - begin);
+				ExpressionParserError error;
+				res[i].reset(new BasicExpression(input, settings, &error, &scratch));
+				if(error) {
+					LineError e;
+					e.line = i;
+					e.error = error;
+					chunk_errors[c].push_back(e);
+				}
+			}
+		});
+	}
+	pool.run(tasks);
+
+	errors.clear();
+	for(const auto &i : chunk_errors) {
+		errors.insert(errors.end(), i.begin(), i.end());
+	}
+	return res;
+}
+
+template <typename T>
+std::vector <std::unique_ptr <BasicExpression<T> > > BasicExpression<T>::parseFile(const std::string &path,
+                                                                                   ThreadPool &pool,
+                                                                                   std::vector <LineError> &errors)
+{
+	MappedFile file(path);
+	return parseLines(file.data(), file.size(), pool, errors);
+}
+
+template <typename T>
+void BasicExpression<T>::parse(ParserInput &input, ExpressionParserError *error,
+                               typename ExpressionParser<T>::Scratch *scratch)
+{
+	ExpressionParser <T> p(*m_settings, input, m_varnames, arena(), scratch);
+	if(error == nullptr) {
+		m_root = p.parse();
+	} else {
+		m_root = p.tryParse();
+		*error = p.error();
+		if(*error) {
+			m_varnames.clear();
+			m_arena->clear();
+		}
+	}
 	if(m_root) {
-		cout << "You entered: " << endl;
-		m_root->print();
-		cout << endl;
-		for(const auto &s : m_varnames) {
-			m_variables[s] = 0.0;
+		m_values.assign(m_varnames.size(), T());
+		for(size_t i = 0; i < m_varnames.size(); ++i) {
+			m_varids[m_varnames[i]] = i;
+		}
+		compile();
+		dropCells();
+	}
+}
+
+template <typename T>
+void BasicExpression<T>::serialize(std::string &out) const
+{
+	BinaryWriter w(out);
+	w.write(BinaryFormat::expression_magic);
+	w.write(BinaryFormat::version);
+	w.write(BinaryFormat::type<T>());
+	w.write(m_hash_consed ? BinaryFormat::hash_consed : uint32_t(0));
+	w.write(static_cast<uint32_t>(m_varnames.size()));
+	for(const auto &i : m_varnames) {
+		w.writeString(i);
+	}
+
+	ensureCompiled();
+	const FlatTree <T> empty;
+	const FlatTree <T> &tree = this->empty() ? empty : *m_tree;
+	w.write(static_cast<uint32_t>(tree.functions().size()));
+	for(auto i : tree.functions()) {
+		w.write(static_cast<uint8_t>(i->type));
+		w.writeString(i->name);
+	}
+	w.write(static_cast<uint32_t>(tree.size()));
+	for(const auto &i : tree.nodes()) {
+		// Node kinds are numbered as cell types
+		w.write(static_cast<uint8_t>(i.kind()));
+		switch(i.kind()) {
+		case FlatTree<T>::Kind::FUNCTION:
+			w.write(i.data);
+			w.write(i.argsNum());
+			for(uint32_t k = 0; k < i.argsNum(); ++k) {
+				w.write(tree.argsOf(i)[k]);
+			}
+			break;
+		case FlatTree<T>::Kind::VARIABLE:
+			w.write(i.data);
+			break;
+		case FlatTree<T>::Kind::CONSTANT:
+			w.write(tree.constants()[i.data]);
+			break;
+		}
+	}
+}
+
+template <typename T>
+std::unique_ptr <BasicExpression<T> > BasicExpression<T>::deserialize(const char *data, size_t size)
+{
+	return deserialize(data, size, defaultSettings());
+}
+
+template <typename T>
+std::unique_ptr <BasicExpression<T> > BasicExpression<T>::deserialize(const char *data, size_t size,
+                                                                      const ExpressionParserSettings <T> &settings)
+{
+	std::unique_ptr <BasicExpression> res(new BasicExpression(settings));
+	BinaryReader in(data, size);
+	res->load(in);
+	return res;
+}
+
+template <typename T>
+void BasicExpression<T>::load(BinaryReader &in)
+{
+	if(in.read<uint32_t>() != BinaryFormat::expression_magic) {
+		throw ExpressionParserException("Not a binary expression");
+	}
+	if(in.read<uint32_t>() != BinaryFormat::version) {
+		throw ExpressionParserException("Unsupported version of binary expression");
+	}
+	if(in.read<uint32_t>() != BinaryFormat::type<T>()) {
+		throw ExpressionParserException("Binary expression has different type of values");
+	}
+	bool hash_consed = (in.read<uint32_t>() & BinaryFormat::hash_consed) != 0;
+	auto malformed = []() {
+		throw ExpressionParserException("Malformed binary expression");
+	};
+
+	size_t vars = in.read<uint32_t>();
+	if(vars > in.left(sizeof(uint32_t))) {
+		malformed();
+	}
+	m_varnames.resize(vars);
+	for(size_t i = 0; i < vars; ++i) {
+		m_varnames[i] = in.readString();
+		if(!m_varids.insert(std::make_pair(m_varnames[i], i)).second) {
+			malformed();
+		}
+	}
+
+	size_t funcs_num = in.read<uint32_t>();
+	if(funcs_num > in.left(sizeof(uint32_t))) {
+		malformed();
+	}
+	std::vector <typename Functions<T>::const_iterator> funcs;
+	for(size_t i = 0; i < funcs_num; ++i) {
+		uint8_t type = in.read<uint8_t>();
+		std::string name = in.readString();
+		if(type > static_cast<uint8_t>(Function<T>::Type::NONE)) {
+			malformed();
+		}
+		auto t = static_cast<typename Function<T>::Type>(type);
+		const Functions <T> &coll = (t == Function<T>::Type::NONE) ? m_settings->functions : m_settings->operators;
+		const FunctionIndex <T> &index = (t == Function<T>::Type::NONE) ? m_settings->functions_index : m_settings->operators_index;
+		size_t pos = index.find(name, t);
+		if(pos == FunctionIndex<T>::npos) {
+			throw ExpressionParserException("Binary expression refers to undefined function \"" + name + "\"");
 		}
+		funcs.push_back(coll.begin() + pos);
+	}
 
-		cout << "Expression: " << endl;
-		for(auto it = m_root->begin(); it != m_root->end(); ++it) {
-			it->print();
-			cout << ", ";
+	size_t n = in.read<uint32_t>();
+	if(n > in.left(1)) {
+		malformed();
+	}
+	// Node table is already in postorder with arguments referred to by indices, so after
+	// validation it's taken as the compiled tree. Cells are built only if they're needed.
+	std::shared_ptr <FlatTree <T> > tree = std::make_shared<FlatTree <T> >();
+	tree->reserve(n, n);
+	// Number of references to each node
+	std::vector <uint32_t> refs(n, 0);
+	std::vector <uint32_t> args;
+	typedef typename FlatTree<T>::Kind Kind;
+	for(size_t i = 0; i < n; ++i) {
+		uint8_t kind = in.read<uint8_t>();
+		switch(kind) {
+		case static_cast<uint8_t>(Kind::FUNCTION):
+		{
+			uint32_t f = in.read<uint32_t>();
+			size_t args_num = in.read<uint32_t>();
+			if((f >= funcs.size()) || (args_num != funcs[f]->args_num) || (args_num > in.left(sizeof(uint32_t)))) {
+				malformed();
+			}
+			args.resize(args_num);
+			for(size_t k = 0; k < args_num; ++k) {
+				uint32_t arg = in.read<uint32_t>();
+				if(arg >= i) {
+					malformed();
+				}
+				++refs[arg];
+				args[k] = arg;
+			}
+			tree->pushFunction(tree->addFunction(funcs[f]), args.data(), static_cast<uint32_t>(args_num));
+			break;
+		}
+		case static_cast<uint8_t>(Kind::VARIABLE):
+		{
+			uint32_t id = in.read<uint32_t>();
+			if(id >= vars) {
+				malformed();
+			}
+			tree->pushVariable(id);
+			break;
+		}
+		case static_cast<uint8_t>(Kind::CONSTANT):
+			tree->pushConstant(in.read<T>());
+			break;
+		default:
+			malformed();
+		}
+	}
+	// Every node but the root must be used
+	for(size_t i = 0; i + 1 < n; ++i) {
+		if(refs[i] == 0) {
+			malformed();
 		}
 	}
+
+	m_hash_consed = hash_consed;
+	m_values.assign(vars, T());
+	if(n > 0) {
+		m_tree = tree;
+		m_root = nullptr;
+		m_has_cells = false;
+		compile();
+	}
 }
 
-Expression::Expression(const Expression &e) :
+template <typename T>
+BasicExpression<T>::BasicExpression(const BasicExpression &e) :
+	m_settings(e.m_settings),
+	m_shared(e.m_shared),
 	m_root(nullptr),
-	m_variables(e.m_variables)
+	m_has_cells(false),
+	m_varnames(e.m_varnames),
+	m_varids(e.m_varids),
+	m_values(e.m_values),
+	m_tree(e.m_tree),
+	m_program(e.m_program),
+	m_native(e.m_native),
+	m_use_native(e.m_use_native),
+	m_gradient(e.m_gradient),
+	m_incremental(e.m_incremental),
+	m_use_incremental(e.m_use_incremental),
+	m_hash_consed(e.m_hash_consed),
+	m_dirty(e.m_dirty.load()),
+	m_subtrees_built(false)
+{
+	// Cells of e may be being built by another thread, they are used only when ready
+	if(e.m_has_cells) {
+		m_root = e.m_root;
+		m_has_cells = true;
+		if(e.m_arena) {
+			m_shared.insert(e.m_arena);
+		}
+	}
+}
+
+template <typename T>
+BasicExpression<T>::BasicExpression(BasicExpression &&e) :
+	m_settings(e.m_settings),
+	m_arena(std::move(e.m_arena)),
+	m_shared(std::move(e.m_shared)),
+	m_root(e.m_root),
+	m_has_cells(e.m_has_cells.load()),
+	m_varnames(std::move(e.m_varnames)),
+	m_varids(std::move(e.m_varids)),
+	m_values(std::move(e.m_values)),
+	m_tree(std::move(e.m_tree)),
+	m_program(std::move(e.m_program)),
+	m_native(std::move(e.m_native)),
+	m_use_native(e.m_use_native),
+	m_gradient(std::move(e.m_gradient)),
+	m_incremental(std::move(e.m_incremental)),
+	m_use_incremental(e.m_use_incremental),
+	m_hash_consed(e.m_hash_consed),
+	m_dirty(e.m_dirty.load()),
+	m_subtrees(std::move(e.m_subtrees)),
+	m_subtrees_built(e.m_subtrees_built.load())
 {
-	m_root = new Cell <int>(*e.m_root);
+	// e becomes an empty expression
+	e.m_root = nullptr;
+	e.m_has_cells = true;
+	e.m_varnames.clear();
+	e.m_varids.clear();
+	e.m_values.clear();
+	e.clearSubtrees();
 }
 
-Expression& Expression::operator=(const Expression &e)
+template <typename T>
+BasicExpression<T>& BasicExpression<T>::operator=(const BasicExpression &e)
 {
 	if(this != &e) {
-		if(m_root != nullptr) {
-			delete m_root;
+		// e may refer to cells of m_arena only if it holds the arena too
+		if(m_arena && (m_arena.use_count() == 1)) {
+			m_arena->clear();
+		} else {
+			m_arena.reset();
 		}
-		m_root = new Cell <int>(*e.m_root);
-		m_variables = e.m_variables;
+		m_shared = e.m_shared;
+		clearSubtrees();
+		m_root = nullptr;
+		m_has_cells = false;
+		if(e.m_has_cells) {
+			m_root = e.m_root;
+			m_has_cells = true;
+			if(e.m_arena) {
+				m_shared.insert(e.m_arena);
+			}
+		}
+		m_settings = e.m_settings;
 		m_varnames = e.m_varnames;
+		m_varids = e.m_varids;
+		m_values = e.m_values;
+		m_tree = e.m_tree;
+		m_program = e.m_program;
+		m_native = e.m_native;
+		m_use_native = e.m_use_native;
+		m_gradient = e.m_gradient;
+		m_incremental = e.m_incremental;
+		m_use_incremental = e.m_use_incremental;
+		m_hash_consed = e.m_hash_consed;
+		m_dirty = e.m_dirty.load();
+	}
+	return *this;
+}
+
+template <typename T>
+BasicExpression<T>& BasicExpression<T>::operator=(BasicExpression &&e)
+{
+	if(this != &e) {
+		m_arena = std::move(e.m_arena);
+		m_shared = std::move(e.m_shared);
+		m_root = e.m_root;
+		m_has_cells = e.m_has_cells.load();
+		m_settings = e.m_settings;
+		m_varnames = std::move(e.m_varnames);
+		m_varids = std::move(e.m_varids);
+		m_values = std::move(e.m_values);
+		m_tree = std::move(e.m_tree);
+		m_program = std::move(e.m_program);
+		m_native = std::move(e.m_native);
+		m_use_native = e.m_use_native;
+		m_gradient = std::move(e.m_gradient);
+		m_incremental = std::move(e.m_incremental);
+		m_use_incremental = e.m_use_incremental;
+		m_hash_consed = e.m_hash_consed;
+		m_dirty = e.m_dirty.load();
+		m_subtrees = std::move(e.m_subtrees);
+		m_subtrees_built = e.m_subtrees_built.load();
+		e.m_root = nullptr;
+		e.m_has_cells = true;
+		e.m_varnames.clear();
+		e.m_varids.clear();
+		e.m_values.clear();
+		e.clearSubtrees();
 	}
 	return *this;
 }
 
-bool Expression::operator==(const Expression &e) const
+template <typename T>
+bool BasicExpression<T>::operator==(const BasicExpression &e) const
 {
-	return (m_root == e.m_root) || ((m_root != nullptr) && (e.m_root != nullptr) && (*m_root == *e.m_root));
+	if(empty() || e.empty()) {
+		return empty() && e.empty();
+	}
+	if((m_tree == e.m_tree) && !m_dirty && !e.m_dirty) {
+		// Copies of one compiled tree
+		return true;
+	}
+	buildCells();
+	e.buildCells();
+	return (m_root == e.m_root) || (*m_root == *e.m_root);
 }
 
-bool Expression::operator!=(const Expression &e) const
+template <typename T>
+bool BasicExpression<T>::operator!=(const BasicExpression &e) const
 {
 	return !(*this == e);
 }
@@ -125,82 +706,419 @@ DEFINE_OPERATORV(-);
 DEFINE_OPERATORV(*);
 DEFINE_OPERATORV(/);
 
-bool Expression::isSubExpression(const Expression &e) const
+template <typename T>
+bool BasicExpression<T>::isSubExpression(const BasicExpression &e) const
 {
-	std::vector <Cell <int>*> curcell;
-	curcell.push_back(e.m_root);
-	while(curcell[curcell.size() - 1]->type == Cell <int>::Type::FUNCTION) {
-		curcell.push_back(curcell[curcell.size() - 1]->func.args[0]);
+	if(empty() || e.empty()) {
+		return e.empty();
+	}
+	buildCells();
+	e.buildCells();
+	if(!m_subtrees_built) {
+		std::lock_guard <std::mutex> lock(m_subtrees_mutex);
+		if(!m_subtrees_built) {
+			for(auto cell : m_root->distinctCells()) {
+				m_subtrees.insert(std::make_pair(cell->hash, cell));
+			}
+			m_subtrees_built = true;
+		}
+	}
+	auto range = m_subtrees.equal_range(e.m_root->hash);
+	for(auto it = range.first; it != range.second; ++it) {
+		if(*it->second == *e.m_root) {
+			return true;
+		}
 	}
-	bool tmp;
-	return m_root->isSubExpression(curcell, tmp);
+	return false;
 }
 
-std::map <std::string, int>& Expression::variables()
+template <typename T>
+size_t BasicExpression<T>::simplify()
 {
-	return m_variables;
+	if(empty()) {
+		return 0;
+	}
+	buildCells();
+	unshare();
+	clearSubtrees();
+	size_t res = ::simplify(m_root);
+	if(m_hash_consed) {
+		::hashCons(m_root);
+	}
+	compile();
+	return res;
 }
 
-int Expression::getVar(size_t id) const
+template <typename T>
+bool BasicExpression<T>::compileNative()
 {
-	if(id >= m_varnames.size()) {
-		throw ExpressionException("Index out of range");
+	m_use_native = true;
+	if(!empty()) {
+		compile();
 	}
-	return m_variables.at(m_varnames[id]);
+	return m_native.compiled();
 }
 
-int Expression::getVar(const std::string &name) const
+template <typename T>
+void BasicExpression<T>::enableIncremental()
 {
-	auto it = m_variables.find(name);
-	if(it == m_variables.end()) {
-		throw ExpressionException("Undefined variable: " + name);
+	m_use_incremental = true;
+	if(!empty()) {
+		compile();
+	}
+}
+
+template <typename T>
+size_t BasicExpression<T>::hashCons()
+{
+	m_hash_consed = true;
+	if(empty()) {
+		return 0;
 	}
-	return m_variables.at(name);
+	buildCells();
+	unshare();
+	clearSubtrees();
+	size_t res = ::hashCons(m_root);
+	compile();
+	return res;
 }
 
-void Expression::setVar(size_t id, int val)
+template <typename T>
+const std::vector <std::string>& BasicExpression<T>::variables() const
 {
-	m_variables[m_varnames[id]] = val;
+	return m_varnames;
 }
 
-void Expression::setVar(const std::string &name, int val)
+template <typename T>
+size_t BasicExpression<T>::varId(const std::string &name) const
 {
-	auto it = m_variables.find(name);
-	if(it == m_variables.end()) {
+	auto it = m_varids.find(name);
+	if(it == m_varids.end()) {
 		throw ExpressionException("Undefined variable: " + name);
 	}
-	it->second = val;
+	return it->second;
 }
 
-Functions<int>::const_iterator Expression::findFunction(const std::string &name, Function<int>::Type type)
+template <typename T>
+T BasicExpression<T>::getVar(size_t id) const
 {
-	auto res = operators.end();
-	for(auto i = operators.begin(); i != operators.end(); ++i) {
-			if((type == i->type) && (name == i->name)) {
-			res = i;
-		}
+	if(id >= m_values.size()) {
+		throw ExpressionException("Index out of range");
 	}
-	return res;
+	return m_values[id];
 }
 
-void Expression::addFunction(const Functions<int>::const_iterator &f, const Expression &e)
+template <typename T>
+T BasicExpression<T>::getVar(const std::string &name) const
 {
-	Cell <int> *tmp = m_root;
-	Cell <int> *arg2 = new Cell <int>(*e.m_root);
-	m_root = new Cell <int>();
-	m_root->type = Cell <int>::Type::FUNCTION;
+	return m_values[varId(name)];
+}
+
+template <typename T>
+void BasicExpression<T>::setVar(size_t id, T val)
+{
+	if(id >= m_values.size()) {
+		throw ExpressionException("Index out of range");
+	}
+	m_values[id] = val;
+	// Otherwise values are taken by the next compile()
+	if(m_use_incremental && !m_dirty) {
+		m_incremental.setVar(id, val);
+	}
+}
+
+template <typename T>
+void BasicExpression<T>::setVar(const std::string &name, T val)
+{
+	setVar(varId(name), val);
+}
+
+template <typename T>
+typename Functions<T>::const_iterator BasicExpression<T>::findFunction(const std::string &name, typename Function<T>::Type type)
+{
+	size_t pos = m_settings->operators_index.find(name, type);
+	return (pos == FunctionIndex<T>::npos) ? m_settings->operators.end() : m_settings->operators.begin() + pos;
+}
+
+template <typename T>
+void BasicExpression<T>::addFunction(const typename Functions<T>::const_iterator &f, const BasicExpression &e)
+{
+	buildCells();
+	e.buildCells();
+	// Variables of e get ids of variables with the same names in this expression
+	std::vector <size_t> ids;
+	bool same_ids = true;
+	for(size_t i = 0; i < e.m_varnames.size(); ++i) {
+		const std::string &name = e.m_varnames[i];
+		auto it = m_varids.find(name);
+		if(it == m_varids.end()) {
+			it = m_varids.insert(std::make_pair(name, m_varnames.size())).first;
+			m_varnames.push_back(name);
+			m_values.push_back(e.m_values[i]);
+		}
+		ids.push_back(it->second);
+		same_ids = same_ids && (it->second == i);
+	}
+	Cell <T> *arg2;
+	if(same_ids) {
+		// Cells of e can be used as they are
+		arg2 = e.m_root;
+		if(&e != this) {
+			// Own arena isn't held as shared, e.g. if e is a copy of this expression
+			for(const auto &i : e.m_shared) {
+				if(i != m_arena) {
+					m_shared.insert(i);
+				}
+			}
+			if(e.m_arena && (e.m_arena != m_arena)) {
+				m_shared.insert(e.m_arena);
+			}
+		}
+	} else {
+		arg2 = e.m_root->clone(arena());
+		// Each shared cell is renumbered once
+		for(auto cell : arg2->distinctCells()) {
+			if(cell->type == Cell <T>::Type::VARIABLE) {
+				cell->var.id = ids[cell->var.id];
+			}
+		}
+	}
+	Cell <T> *tmp = m_root;
+	m_root = arena().create();
+	m_root->type = Cell <T>::Type::FUNCTION;
 	m_root->func.iter = f;
 	m_root->func.args.push_back(tmp);
 	m_root->func.args.push_back(arg2);
+	m_root->updateNodeHash();
+	clearSubtrees();
+	if(m_hash_consed) {
+		unshare();
+		::hashCons(m_root);
+	}
+	m_dirty = true;
 }
 
-void Expression::print()
+template <typename T>
+void BasicExpression<T>::compile()
 {
-	m_root->print();
+	if(m_has_cells) {
+		std::shared_ptr <FlatTree <T> > tree = std::make_shared<FlatTree <T> >();
+		tree->build(m_root);
+		m_tree = tree;
+	}
+	m_program.compile(*m_tree);
+	if(m_use_native) {
+		m_native.compile(m_program);
+	}
+	if(m_use_incremental) {
+		m_incremental.compile(m_tree, m_values);
+	}
+	// Tape is recorded by the first evalGradient()
+	m_gradient.clear();
+	m_dirty = false;
 }
 
+template <typename T>
+void BasicExpression<T>::ensureCompiled() const
+{
+	if(m_dirty) {
+		std::lock_guard <std::mutex> lock(m_compile_mutex);
+		if(m_dirty) {
+			// Compiled program isn't a visible part of the state, so it's updated even
+			// through const methods
+			const_cast<BasicExpression*>(this)->compile();
+		}
+	}
+}
 
-int Expression::eval()
+template <typename T>
+bool BasicExpression<T>::empty() const
 {
-	return m_root->eval(m_variables);
+	// Without cells the tree is in m_tree
+	return m_has_cells && (m_root == nullptr);
 }
+
+template <typename T>
+void BasicExpression<T>::buildCells() const
+{
+	if(!m_has_cells) {
+		std::lock_guard <std::mutex> lock(m_cells_mutex);
+		if(!m_has_cells) {
+			// Cells aren't a visible part of the state, so they are built even through
+			// const methods
+			BasicExpression *self = const_cast<BasicExpression*>(this);
+			self->m_root = m_tree->cells(self->arena(), m_varnames);
+			m_has_cells = true;
+		}
+	}
+}
+
+template <typename T>
+void BasicExpression<T>::dropCells()
+{
+	if(!m_has_cells || (m_root == nullptr) || m_dirty || shared()) {
+		return;
+	}
+	clearSubtrees();
+	m_root = nullptr;
+	m_arena.reset();
+	m_has_cells = false;
+}
+
+template <typename T>
+CellArena <T>& BasicExpression<T>::arena()
+{
+	if(!m_arena) {
+		m_arena = std::make_shared<CellArena <T> >();
+	}
+	return *m_arena;
+}
+
+template <typename T>
+bool BasicExpression<T>::shared() const
+{
+	return !m_shared.empty() || (m_arena && (m_arena.use_count() > 1));
+}
+
+template <typename T>
+void BasicExpression<T>::unshare()
+{
+	if(!shared()) {
+		return;
+	}
+	std::shared_ptr <CellArena <T> > arena = std::make_shared<CellArena <T> >();
+	if(m_root != nullptr) {
+		m_root = m_root->clone(*arena);
+		if(m_hash_consed) {
+			::hashCons(m_root);
+		}
+	}
+	m_arena = arena;
+	m_shared.clear();
+	clearSubtrees();
+}
+
+template <typename T>
+void BasicExpression<T>::clearSubtrees()
+{
+	m_subtrees.clear();
+	m_subtrees_built = false;
+}
+
+template <typename T>
+void BasicExpression<T>::print() const
+{
+	if(!empty()) {
+		buildCells();
+		m_root->print();
+	}
+}
+
+
+template <typename T>
+T BasicExpression<T>::eval()
+{
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	if(m_use_incremental) {
+		return m_incremental.eval();
+	}
+	return eval(m_values.data());
+}
+
+template <typename T>
+T BasicExpression<T>::eval(const T *values)
+{
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	if(m_native.compiled()) {
+		return m_native.eval(values);
+	}
+	return m_program.eval(values);
+}
+
+template <typename T>
+T BasicExpression<T>::eval(const T *values, typename Program<T>::State &state) const
+{
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	if(m_native.compiled()) {
+		return m_native.eval(values);
+	}
+	return m_program.eval(values, state);
+}
+
+template <typename T>
+T BasicExpression<T>::evalGradient(std::vector <T> &grad)
+{
+	grad.resize(m_values.size());
+	return evalGradient(m_values.data(), grad.data());
+}
+
+template <typename T>
+T BasicExpression<T>::evalGradient(const T *values, T *grad)
+{
+	if(!std::is_floating_point<T>::value) {
+		throw ExpressionException("Gradients are only supported for floating-point expressions");
+	}
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	if(m_gradient.empty()) {
+		m_gradient.compile(m_tree, m_varnames.size());
+		const Function <T> *f = m_gradient.undifferentiable();
+		if(f != nullptr) {
+			m_gradient.clear();
+			throw ExpressionException("Function \"" + f->name + "\" has no derivative rule");
+		}
+	}
+	return m_gradient.eval(values, grad);
+}
+
+template <typename T>
+void BasicExpression<T>::evalBatch(const T *const *columns, size_t n, T *out)
+{
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	m_program.evalBatch(columns, n, out);
+}
+
+template <typename T>
+void BasicExpression<T>::evalParallel(const T *const *columns, size_t n, T *out, ThreadPool &pool,
+                              size_t chunk_size) const
+{
+	if(empty()) {
+		throw ExpressionException("Attempt to evaluate empty expression");
+	}
+	ensureCompiled();
+	const size_t bs = Program<T>::block_size;
+	if(chunk_size == 0) {
+		// Several chunks per thread, so that threads that finish early can steal the rest
+		chunk_size = n / (pool.size() * 8);
+	}
+	chunk_size = std::max(bs, (chunk_size + bs - 1) / bs * bs);
+	const Program <T> &program = m_program;
+	std::vector <ThreadPool::Task> tasks;
+	for(size_t begin = 0; begin < n; begin += chunk_size) {
+		size_t end = std::min(n, begin + chunk_size);
+		tasks.push_back([&program, columns, begin, end, out]() {
+			typename Program<T>::State state;
+			program.evalBatch(columns, begin, end, out, state);
+		});
+	}
+	pool.run(tasks);
+}
+
+template class BasicExpression <int>;
+template class BasicExpression <int64_t>;
+template class BasicExpression <float>;
+template class BasicExpression <double>;
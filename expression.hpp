@@ -1,51 +1,242 @@
 #ifndef EXPRESSION_H
 #define EXPRESSION_H
 
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "expression_binary.hpp"
 #include "expression_parser.hpp"
+#include "expression_program.hpp"
+#include "expression_native.hpp"
+#include "expression_gradient.hpp"
+#include "expression_incremental.hpp"
+#include "expression_simplify.hpp"
+#include "thread_pool.hpp"
 
-class Expression
+template <typename T>
+class BasicExpressionCache;
+
+// Expression over values of type T. Member functions are defined in expression.cpp and
+// instantiated there for int, int64_t, float and double (see typedefs below).
+// Parsed and loaded expressions keep their tree only in compiled form (see FlatTree).
+// Cells, which are needed to modify, compare or search the tree, are built on first use.
+template <typename T>
+class BasicExpression
 {
 public:
-	Expression(const std::string &s);
-	Expression(const Expression &e);
+	BasicExpression(const std::string &s);
+	// Parses s using custom grammar. Settings must outlive the expression and all its copies.
+	BasicExpression(const std::string &s, const ExpressionParserSettings <T> &settings);
+	// Parses text of the input (e.g. a stream or a memory-mapped file) without copying it
+	// into a string, see ParserInput
+	explicit BasicExpression(ParserInput &input);
+	BasicExpression(ParserInput &input, const ExpressionParserSettings <T> &settings);
+	BasicExpression(const BasicExpression &e);
+	BasicExpression(BasicExpression &&e);
+
+	// Parse s without throwing and without console output. If s is malformed, error is set
+	// and an empty expression is returned, otherwise error code is NONE.
+	static BasicExpression tryParse(const std::string &s, ExpressionParserError &error);
+	static BasicExpression tryParse(const std::string &s, const ExpressionParserSettings <T> &settings,
+	                                ExpressionParserError &error);
+	static BasicExpression tryParse(ParserInput &input, ExpressionParserError &error);
+	static BasicExpression tryParse(ParserInput &input, const ExpressionParserSettings <T> &settings,
+	                                ExpressionParserError &error);
+
+	// Error in one line of parseLines()
+	struct LineError
+	{
+		// Zero-based index of the line
+		size_t line;
+		ExpressionParserError error;
+	};
+	// Parses each line of the text as a separate expression using threads of the pool.
+	// Result i is the expression from line i; lines with errors get empty expressions and
+	// are reported in errors (in order of lines) without stopping the rest. Blank lines
+	// (empty or of whitespace only) are skipped: their results are null and they aren't
+	// errors. All expressions share settings, which must outlive them.
+	static std::vector <std::unique_ptr <BasicExpression> > parseLines(const char *data, size_t size, ThreadPool &pool,
+	                                                                    std::vector <LineError> &errors);
+	static std::vector <std::unique_ptr <BasicExpression> > parseLines(const char *data, size_t size, ThreadPool &pool,
+	                                                                    std::vector <LineError> &errors,
+	                                                                    const ExpressionParserSettings <T> &settings);
+	// Same for the lines of a file, which is memory-mapped instead of being read
+	static std::vector <std::unique_ptr <BasicExpression> > parseFile(const std::string &path, ThreadPool &pool,
+	                                                                   std::vector <LineError> &errors);
+
+	// Appends the expression in binary format (see BinaryFormat) to out. Functions are
+	// stored by name, values of variables aren't stored.
+	void serialize(std::string &out) const;
+	// Loads an expression written by serialize() without parsing. Functions are looked up
+	// by name in the grammar. Throws ExpressionParserException if data is malformed.
+	static std::unique_ptr <BasicExpression> deserialize(const char *data, size_t size);
+	static std::unique_ptr <BasicExpression> deserialize(const char *data, size_t size,
+	                                                     const ExpressionParserSettings <T> &settings);
+
+	// Copies share cells with the original, so copying doesn't depend on the size of the tree.
+	// Shared cells are never modified, an expression copies its tree before modifying it.
+	BasicExpression& operator=(const BasicExpression &e);
+	BasicExpression& operator=(BasicExpression &&e);
+
+	bool operator==(const BasicExpression &e) const;
+	bool operator!=(const BasicExpression &e) const;
 
-	Expression& operator=(const Expression &e);
+	BasicExpression& operator+=(const BasicExpression &e);
+	BasicExpression& operator-=(const BasicExpression &e);
+	BasicExpression& operator*=(const BasicExpression &e);
+	BasicExpression& operator/=(const BasicExpression &e);
 
-	bool operator==(const Expression &e) const;
-	bool operator!=(const Expression &e) const;
+	// Right operand isn't copied, the result shares its cells. For a temporary left operand
+	// (e.g. in a + b + c) the result is built in place, so composing n expressions costs O(n).
+	// A named left operand is copied with its variables and list of shared arenas, so
+	// acc = acc + e in a loop is quadratic; use acc += e or std::move(acc) + e instead.
+	BasicExpression operator+(const BasicExpression &e) const &;
+	BasicExpression operator-(const BasicExpression &e) const &;
+	BasicExpression operator*(const BasicExpression &e) const &;
+	BasicExpression operator/(const BasicExpression &e) const &;
+	BasicExpression operator+(const BasicExpression &e) &&;
+	BasicExpression operator-(const BasicExpression &e) &&;
+	BasicExpression operator*(const BasicExpression &e) &&;
+	BasicExpression operator/(const BasicExpression &e) &&;
 
-	Expression& operator+=(const Expression &e);
-	Expression& operator-=(const Expression &e);
-	Expression& operator*=(const Expression &e);
-	Expression& operator/=(const Expression &e);
+	// The first call builds an index of all subtrees by their hashes, so next calls only
+	// look up the hash of e and compare subtrees with the same hash
+	bool isSubExpression(const BasicExpression &e) const;
 
-	Expression operator+(const Expression &e) const;
-	Expression operator-(const Expression &e) const;
-	Expression operator*(const Expression &e) const;
-	Expression operator/(const Expression &e) const;
+	// Folds constants and removes trivial operations (see ::simplify), returns the number
+	// of removed cells
+	size_t simplify();
+	// Makes equal subexpressions share one cell, so that each of them is evaluated only
+	// once (see ::hashCons). Expression stays in this mode after further modifications.
+	// Returns the number of cells that became unused.
+	size_t hashCons();
+	// Switches scalar evaluation to native machine code (see NativeProgram). Returns false
+	// if native code isn't supported, the interpreter is used in that case.
+	bool compileNative();
+	// Switches eval() (without arguments) to incremental mode: the last value of each
+	// subexpression is kept and only subexpressions depending on variables changed by
+	// setVar since the previous eval() are recomputed
+	void enableIncremental();
 
-	bool isSubExpression(const Expression &e) const;
+	// Names of variables, position of the name is the id of the variable
+	const std::vector <std::string>& variables() const;
+	// Returns id of the variable, it's intended to be looked up once and then used with
+	// id-based accessors below
+	size_t varId(const std::string &name) const;
+	T getVar(size_t id) const;
+	T getVar(const std::string &name) const;
+	void setVar(size_t id, T val);
+	void setVar(const std::string &name, T val);
 
-	std::map <std::string, int>& variables();
-	int getVar(size_t id) const;
-	int getVar(const std::string &name) const;
-	void setVar(size_t id, int val);
-	void setVar(const std::string &name, int val);
+	T eval();
+	// Evaluates with values[i] used as the value of variable with id i. Values of
+	// variables stored in the expression are ignored.
+	T eval(const T *values);
+	// Same, but doesn't modify the expression, so it may be called concurrently (e.g. for
+	// expressions shared through ExpressionCache) as long as each thread has its own state
+	T eval(const T *values, typename Program<T>::State &state) const;
+	// Evaluates the expression and its gradient by reverse-mode differentiation, which
+	// costs about two evaluations for any number of variables. grad is resized to the
+	// number of variables and grad[i] is set to the derivative by variable with id i.
+	// Every function of the expression must have a derivative rule (see Function::derivative).
+	// Only for floating-point T, derivatives over integers would be truncated, so for other
+	// types ExpressionException is thrown.
+	T evalGradient(std::vector <T> &grad);
+	// Same, but with values[i] used as the value of variable with id i
+	T evalGradient(const T *values, T *grad);
+	// Evaluates n rows at once, columns[i][j] is the value of variable with id i in row j.
+	// Result for row j is written to out[j].
+	void evalBatch(const T *const *columns, size_t n, T *out);
+	// Same as evalBatch, but rows are split into chunks of chunk_size rows (zero means
+	// choose automatically) that are evaluated by threads of the pool. Doesn't modify the
+	// expression, so it may be called for the same expression from several threads.
+	void evalParallel(const T *const *columns, size_t n, T *out, ThreadPool &pool,
+	                  size_t chunk_size = 0) const;
 
-	int eval();
+	// Prints the tree to cout in prefix notation
+	void print() const;
 
-	void print();
+	// Grammar with built-in operators and functions. It's built once per process.
+	static const ExpressionParserSettings <T>& defaultSettings();
 protected:
-	Functions<int>::const_iterator findFunction(const std::string &name, Function<int>::Type type);
-	void addFunction(const Functions<int>::const_iterator &f, const Expression &e);
+	friend class BasicExpressionCache <T>;
 
-	Cell<int> *m_root;
-	std::map <std::string, int> m_variables;
+	// Parses without throwing if error isn't null. Parser uses scratch if it isn't null.
+	BasicExpression(ParserInput &input, const ExpressionParserSettings <T> &settings,
+	                ExpressionParserError *error, typename ExpressionParser<T>::Scratch *scratch = nullptr);
+
+	// Empty expression
+	explicit BasicExpression(const ExpressionParserSettings <T> &settings);
+
+	void parse(ParserInput &input, ExpressionParserError *error = nullptr,
+	           typename ExpressionParser<T>::Scratch *scratch = nullptr);
+	void load(BinaryReader &in);
+	// Compiles m_root (only m_tree if there are no cells), has to be called whenever the
+	// tree changes
+	void compile();
+	// Compiles m_root if it changed after the last compile()
+	void ensureCompiled() const;
+	// Whether the expression has no tree
+	bool empty() const;
+	// Builds m_root from m_tree if the expression has no cells
+	void buildCells() const;
+	// Frees cells if the expression is compiled and nobody shares them, m_tree is kept
+	void dropCells();
+	// Arena where new cells are created
+	CellArena <T>& arena();
+	// Whether cells of the tree may be referenced by other expressions
+	bool shared() const;
+	// Makes the tree owned only by this expression, has to be called before modifying cells
+	void unshare();
+	// Drops the index of subtrees, has to be called whenever the tree changes
+	void clearSubtrees();
+
+	typename Functions<T>::const_iterator findFunction(const std::string &name, typename Function<T>::Type type);
+	void addFunction(const typename Functions<T>::const_iterator &f, const BasicExpression &e);
+
+	const ExpressionParserSettings <T> *m_settings;
+	// Owns cells created by this expression, it's created on demand. Other expressions
+	// may refer to its cells, so it's only cleared when nobody else holds it.
+	std::shared_ptr <CellArena <T> > m_arena;
+	// Arenas of other expressions with cells of the tree, each of them is held once
+	std::unordered_set <std::shared_ptr <const CellArena <T> > > m_shared;
+	Cell<T> *m_root;
+	// Whether m_root is valid, otherwise the tree is only in m_tree. Cells are built
+	// under the mutex, so that const methods may be called concurrently.
+	mutable std::atomic <bool> m_has_cells;
+	mutable std::mutex m_cells_mutex;
 	std::vector <std::string> m_varnames;
+	std::map <std::string, size_t> m_varids;
+	// Values of variables in order of m_varnames
+	std::vector <T> m_values;
+	// Compiled m_root. The flat tree is built once by compile() and shared with copies
+	// and with evaluators below. It's the only form of the tree while there are no cells.
+	std::shared_ptr <const FlatTree <T> > m_tree;
+	Program <T> m_program;
+	NativeProgram <T> m_native;
+	bool m_use_native;
+	GradientTape <T> m_gradient;
+	IncrementalEvaluator <T> m_incremental;
+	bool m_use_incremental;
+	// Whether equal subtrees of m_root have to share cells
+	bool m_hash_consed;
+	// Whether the tree changed after the last compile(). Operators don't compile the tree,
+	// so that composing many expressions compiles it once.
+	mutable std::atomic <bool> m_dirty;
+	mutable std::mutex m_compile_mutex;
+	// Subtrees of m_root by their hashes, built by isSubExpression and cleared whenever
+	// the tree changes. It's built under the mutex, so that const methods may be called
+	// concurrently.
+	mutable std::unordered_multimap <size_t, const Cell <T>*> m_subtrees;
+	mutable std::atomic <bool> m_subtrees_built;
+	mutable std::mutex m_subtrees_mutex;
 };
 
 class ExpressionException : public std::exception
@@ -60,4 +251,14 @@ protected:
 	std::string m_s;
 };
 
+typedef BasicExpression <int> Expression;
+typedef BasicExpression <int64_t> Int64Expression;
+typedef BasicExpression <float> FloatExpression;
+typedef BasicExpression <double> DoubleExpression;
+
+extern template class BasicExpression <int>;
+extern template class BasicExpression <int64_t>;
+extern template class BasicExpression <float>;
+extern template class BasicExpression <double>;
+
 #endif
@@ -0,0 +1,105 @@
+#ifndef EXPRESSION_ARENA_H
+#define EXPRESSION_ARENA_H
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "expression_cell.hpp"
+
+// Owns cells of one expression. Cells are placed one after another in large chunks, so
+// creating a cell doesn't call malloc and cells of a tree lie close to each other in memory.
+// Chunks grow geometrically, so small expressions don't reserve space for many cells.
+// All cells are released at once by clear() or by the destructor; the memory is kept
+// for reuse until the arena itself is destroyed.
+template <typename T>
+class CellArena
+{
+public:
+	CellArena() :
+		m_current(0),
+		m_used(0)
+	{
+	}
+	~CellArena()
+	{
+		clear();
+	}
+
+	CellArena(const CellArena&) = delete;
+	CellArena& operator=(const CellArena&) = delete;
+
+	Cell <T>* create()
+	{
+		if(m_chunks.empty() || (m_chunks[m_current].used == m_chunks[m_current].size)) {
+			if(!m_chunks.empty()) {
+				++m_current;
+			}
+			if(m_current == m_chunks.size()) {
+				size_t size = std::min(max_chunk_size, min_chunk_size << std::min<size_t>(m_chunks.size(), 16));
+				m_chunks.push_back(Chunk(size));
+			}
+		}
+		Chunk &chunk = m_chunks[m_current];
+		Cell <T> *res = new(&chunk.cells[chunk.used]) Cell <T>();
+		++chunk.used;
+		++m_used;
+		return res;
+	}
+
+	// Allocates memory for n cells at once if the arena has no memory yet, e.g. when the
+	// size of the tree is known in advance
+	void reserve(size_t n)
+	{
+		if(m_chunks.empty() && (n > 0)) {
+			m_chunks.push_back(Chunk(std::max(n, min_chunk_size)));
+		}
+	}
+
+	// Destroys all cells created by this arena
+	void clear()
+	{
+		for(auto &chunk : m_chunks) {
+			for(size_t i = 0; i < chunk.used; ++i) {
+				reinterpret_cast<Cell <T>*>(&chunk.cells[i])->~Cell();
+			}
+			chunk.used = 0;
+		}
+		m_current = 0;
+		m_used = 0;
+	}
+
+	// Number of cells currently allocated
+	size_t size() const
+	{
+		return m_used;
+	}
+protected:
+	static const size_t min_chunk_size = 8;
+	static const size_t max_chunk_size = 256;
+	typedef typename std::aligned_storage<sizeof(Cell <T>), alignof(Cell <T>)>::type Storage;
+
+	struct Chunk
+	{
+		explicit Chunk(size_t _size) :
+			cells(new Storage[_size]), size(_size), used(0)
+		{
+		}
+		std::unique_ptr <Storage[]> cells;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector <Chunk> m_chunks;
+	// Chunk where next cell is created
+	size_t m_current;
+	size_t m_used;
+};
+
+template <typename T>
+const size_t CellArena<T>::min_chunk_size;
+template <typename T>
+const size_t CellArena<T>::max_chunk_size;
+
+#endif
@@ -2,9 +2,14 @@
 #define EXPRESSION_BASE_H
 
 #include <functional>
+#include <map>
+#include <regex>
 #include <vector>
 #include <string>
 #include <cassert>
+#include <exception>
+
+#include "expression_index.hpp"
 
 template <typename T>
 struct Function;
@@ -18,33 +23,91 @@ using Args = std::vector <T>;
 template <typename T>
 using Vars = std::map <std::string, T>;
 
+// Mixes h into seed (same as boost::hash_combine)
+inline void hashCombine(size_t &seed, size_t h)
+{
+	seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
 template <typename T>
 struct Function
 {
 	enum class Type {PREFIX, INFIX, POSTFIX, NONE};
+	// Operations that compiled expressions execute directly instead of calling func.
+	// Grammar author is responsible for func implementing the same operation.
+	enum class Builtin {NONE, ADD, SUB, MUL, DIV, NEG, ABS, MIN, MAX};
+	// Implementations with number of arguments fixed at compile time
+	typedef T (*Unary)(T);
+	typedef T (*Binary)(T, T);
+	// Derivative rule: sets d[i] to the partial derivative of the function by argument i
+	// at arguments a, res is the value of the function there. d has the size of a.
+	typedef std::function<void(const Args <T> &a, T res, Args <T> &d)> Derivative;
+
 	// Precedence is only for operators
 	// For prefix/postfix operators (these always have exactly one argument).
 	Function(const std::string &s, int p, const FuncLambda <T> &f, Type _type) :
-		name(s), precedence(p), func(f), type(_type), args_num(1), is_commutative(false)
+		name(s), precedence(p), func(f), type(_type), args_num(1), is_commutative(false),
+		builtin(Builtin::NONE), unary(nullptr), binary(nullptr), nothrow(false)
 	{
 		assert(type != Type::INFIX);
 	}
 
 	// For infix operators
 	Function(const std::string &s, int p, const FuncLambda <T> &f, bool _is_commutative) :
-		name(s), precedence(p), func(f), type(Type::INFIX), args_num(2), is_commutative(_is_commutative)
+		name(s), precedence(p), func(f), type(Type::INFIX), args_num(2), is_commutative(_is_commutative),
+		builtin(Builtin::NONE), unary(nullptr), binary(nullptr), nothrow(false)
 	{
 	}
 
 	// For functions
 	Function(const std::string &s, const FuncLambda <T> &f, int n = 1) :
-		name(s), precedence(0), func(f), args_num(n), is_commutative(false)
+		name(s), precedence(0), func(f), type(Type::NONE), args_num(n), is_commutative(false),
+		builtin(Builtin::NONE), unary(nullptr), binary(nullptr), nothrow(false)
+	{
+	}
+
+	// Same as above, but with plain functions of fixed arity. Compiled expressions call
+	// them directly instead of going through std::function with a vector of arguments.
+	Function(const std::string &s, int p, Unary f, Type _type) :
+		Function(s, p, [f](const Args <T> &a){return f(a[0]);}, _type)
+	{
+		unary = f;
+	}
+
+	Function(const std::string &s, int p, Binary f, bool _is_commutative) :
+		Function(s, p, [f](const Args <T> &a){return f(a[0], a[1]);}, _is_commutative)
+	{
+		binary = f;
+	}
+
+	Function(const std::string &s, Unary f) :
+		Function(s, [f](const Args <T> &a){return f(a[0]);}, 1)
+	{
+		unary = f;
+	}
+
+	Function(const std::string &s, Binary f) :
+		Function(s, [f](const Args <T> &a){return f(a[0], a[1]);}, 2)
 	{
+		binary = f;
 	}
 
 	Function(const Function <T> &f) :
-		name(f.name), precedence(f.precedence), func(f.func), type(f.type), args_num(f.args_num), is_commutative(f.is_commutative)
+		name(f.name), precedence(f.precedence), func(f.func), type(f.type), args_num(f.args_num), is_commutative(f.is_commutative),
+		builtin(f.builtin), unary(f.unary), binary(f.binary), nothrow(f.nothrow), derivative(f.derivative)
+	{
+	}
+
+	Function(const Function <T> &f, Builtin b) :
+		Function(f)
+	{
+		builtin = b;
+	}
+
+	Function(const Function <T> &f, const Derivative &d) :
+		Function(f)
 	{
+		derivative = d;
 	}
 	std::string name;
 	int precedence;
@@ -52,24 +115,51 @@ struct Function
 	Type type;
 	size_t args_num;
 	bool is_commutative;
+	Builtin builtin;
+	// Set if the function was created from a plain function of one/two arguments
+	Unary unary;
+	Binary binary;
+	// Set if unary/binary never throw, native code (see NativeProgram) calls only such
+	// functions directly and catches exceptions of the others
+	bool nothrow;
+	// Used by BasicExpression::evalGradient, not needed for built-in operations
+	Derivative derivative;
+
+	// Plain functions calling operator() of a stateless functor F, so that it can be inlined,
+	// e.g. Function<double>("sqr", &Function<double>::apply1<Square>)
+	template <typename F>
+	static T apply1(T a)
+	{
+		return F()(a);
+	}
+	template <typename F>
+	static T apply2(T a, T b)
+	{
+		return F()(a, b);
+	}
 };
 
+// Grammar used by ExpressionParser. Parser never modifies it, so one instance may be
+// built once and shared by any number of parsers, including ones running concurrently.
+// Cells produced by the parser refer to functions stored here, so settings must outlive them.
 template <typename T>
 struct ExpressionParserSettings
 {
 public:
-	ExpressionParserSettings(const Functions<T> &_operators, const Functions <T> &_functions,
-	                         std::vector <std::string> &_variables) :
-		operators(_operators), functions(_functions), variables(_variables)
+	ExpressionParserSettings(const Functions<T> &_operators, const Functions <T> &_functions) :
+		operators(_operators), functions(_functions),
+		operators_index(operators), functions_index(functions), use_regex(false)
 	{
 	}
-	ExpressionParserSettings(const ExpressionParserSettings &s) :
-		operators(s.operators), functions(s.functions), variables(s.variables)
-	{
-	}
-	const Functions <T> &operators;
-	const Functions <T> &functions;
-	std::vector <std::string> &variables;
+	const Functions <T> operators;
+	const Functions <T> functions;
+	// Name lookup tables for the collections above
+	const FunctionIndex <T> operators_index;
+	const FunctionIndex <T> functions_index;
+
+	// By default tokens are recognised by the built-in single-pass lexer. Set this flag
+	// to use regexes below instead (e.g. for grammars with custom tokens).
+	bool use_regex;
 
 	std::regex regex_whitespace;
 	std::regex regex_constant;
@@ -82,16 +172,94 @@ public:
 };
 
 
+// Error of parsing: what went wrong and where
+struct ExpressionParserError
+{
+	enum class Code {
+		NONE,
+		MISMATCHED_PARENTHESES,
+		UNFINISHED_FUNCTION_CALL,
+		EXPECTED_RIGHT_ARGUMENT,
+		UNRECOGNISED_TOKEN,
+		EXPECTED_OPERATOR_BETWEEN_VALUES,
+		EXPECTED_PREFIX_OPERATOR,
+		EXPECTED_INFIX_OR_POSTFIX_OPERATOR,
+		EXPECTED_OPERATOR,
+		UNDEFINED_FUNCTION,
+		UNFINISHED_EXPRESSION,
+		EXCESS_ARGUMENT,
+		NOT_ENOUGH_ARGUMENTS
+	};
+
+	ExpressionParserError() :
+		code(Code::NONE), offset(0)
+	{
+	}
+
+	// True if there is an error
+	explicit operator bool() const
+	{
+		return code != Code::NONE;
+	}
+
+	const char* message() const
+	{
+		switch(code) {
+		case Code::NONE:
+			return "No error";
+		case Code::MISMATCHED_PARENTHESES:
+			return "Mismatched parentheses";
+		case Code::UNFINISHED_FUNCTION_CALL:
+			return "Unfinished function call";
+		case Code::EXPECTED_RIGHT_ARGUMENT:
+			return "Expected right argument for operator";
+		case Code::UNRECOGNISED_TOKEN:
+			return "Unrecognised token";
+		case Code::EXPECTED_OPERATOR_BETWEEN_VALUES:
+			return "Expected operator between two values";
+		case Code::EXPECTED_PREFIX_OPERATOR:
+			return "Expected prefix operator";
+		case Code::EXPECTED_INFIX_OR_POSTFIX_OPERATOR:
+			return "Expected infix or postfix operator";
+		case Code::EXPECTED_OPERATOR:
+			return "Expected operator";
+		case Code::UNDEFINED_FUNCTION:
+			return "Undefined function";
+		case Code::UNFINISHED_EXPRESSION:
+			return "Unfinished expression";
+		case Code::EXCESS_ARGUMENT:
+			return "Excess argument";
+		case Code::NOT_ENOUGH_ARGUMENTS:
+			return "Not enough arguments";
+		}
+		return "Unknown error";
+	}
+
+	Code code;
+	// Position in the parsed string
+	size_t offset;
+};
+
 class ExpressionParserException : public std::exception
 {
 public:
 	ExpressionParserException(const std::string &s) noexcept : m_s(s) {}
+	ExpressionParserException(const std::string &s, const ExpressionParserError &e) noexcept :
+		m_s(s), m_error(e)
+	{
+	}
 	virtual const char* what() const noexcept override
 	{
 		return m_s.c_str();
 	}
+	// Code is NONE if the exception isn't caused by a malformed string
+	const ExpressionParserError& error() const noexcept
+	{
+		return m_error;
+	}
 protected:
 	std::string m_s;
+	ExpressionParserError m_error;
 };
 
 #endif
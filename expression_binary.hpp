@@ -0,0 +1,112 @@
+#ifndef EXPRESSION_BINARY_H
+#define EXPRESSION_BINARY_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include "expression_base.hpp"
+
+// Binary format of expressions (see BasicExpression::serialize). Numbers are stored in the
+// byte order of the machine, a file written on a machine with the other byte order is
+// rejected because its magic doesn't match.
+//
+// Expression:  magic, version, type, flags (u32 each),
+//              variables: count (u32), names (strings),
+//              functions: count (u32), for each one its type (u8) and name (string),
+//              nodes: count (u32), nodes in postorder, the last one is the root.
+// Node:        kind (u8, FlatTree::Kind), then for functions index in the table of functions
+//              (u32), number of arguments (u32) and indices of argument nodes (u32 each),
+//              for variables id (u32), for constants the value (sizeof(T) bytes).
+// String:      length (u32) and characters.
+// Bundle:      magic, version, type, reserved (u32 each), count of expressions (u64),
+//              count + 1 offsets of expressions from the beginning of the bundle (u64 each),
+//              expressions.
+struct BinaryFormat
+{
+	static const uint32_t expression_magic = 0x52505845; // "EXPR"
+	static const uint32_t bundle_magic = 0x42505845;     // "EXPB"
+	static const uint32_t version = 1;
+	// Flags of expressions
+	static const uint32_t hash_consed = 1;
+
+	// Expressions are loaded only by expressions of the same type
+	template <typename T>
+	static uint32_t type()
+	{
+		return (std::is_floating_point<T>::value ? 0x100 : 0) | static_cast<uint32_t>(sizeof(T));
+	}
+};
+
+class BinaryWriter
+{
+public:
+	// Data is appended to out
+	explicit BinaryWriter(std::string &out) :
+		m_out(out)
+	{
+	}
+
+	template <typename V>
+	void write(V v)
+	{
+		m_out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+	}
+	void writeString(const std::string &s)
+	{
+		write(static_cast<uint32_t>(s.length()));
+		m_out.append(s);
+	}
+private:
+	std::string &m_out;
+};
+
+// Reads data in place, nothing is copied except values themselves. Throws
+// ExpressionParserException if data ends too early.
+class BinaryReader
+{
+public:
+	BinaryReader(const char *data, size_t size) :
+		m_data(data), m_size(size), m_pos(0)
+	{
+	}
+
+	template <typename V>
+	V read()
+	{
+		need(sizeof(V));
+		V res;
+		// Data isn't necessarily aligned
+		std::memcpy(&res, m_data + m_pos, sizeof(V));
+		m_pos += sizeof(V);
+		return res;
+	}
+	std::string readString()
+	{
+		size_t length = read<uint32_t>();
+		need(length);
+		std::string res(m_data + m_pos, length);
+		m_pos += length;
+		return res;
+	}
+	// Number of values of size item_size that may follow, for checking counts before
+	// allocating memory for them
+	size_t left(size_t item_size) const
+	{
+		return (m_size - m_pos) / item_size;
+	}
+private:
+	void need(size_t n) const
+	{
+		if(m_size - m_pos < n) {
+			throw ExpressionParserException("Truncated binary expression");
+		}
+	}
+
+	const char *m_data;
+	size_t m_size;
+	size_t m_pos;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef EXPRESSION_BUNDLE_H
+#define EXPRESSION_BUNDLE_H
+
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "expression_input.hpp"
+
+// Many expressions in binary format in one file (see BinaryFormat). Opening a bundle maps
+// the file and checks its header, expressions are loaded on demand directly from the
+// mapped memory. Offsets of an expression are checked when it's loaded, so opening doesn't
+// read the table of offsets and costs the same for any number of expressions. Loading is
+// const, so expressions may be loaded concurrently.
+template <typename T>
+class BasicExpressionBundle
+{
+public:
+	// Settings must outlive all expressions loaded from the bundle
+	explicit BasicExpressionBundle(const std::string &path) :
+		BasicExpressionBundle(path, BasicExpression<T>::defaultSettings())
+	{
+	}
+	BasicExpressionBundle(const std::string &path, const ExpressionParserSettings <T> &settings) :
+		m_file(new MappedFile(path)), m_settings(settings)
+	{
+		open(m_file->data(), m_file->size());
+	}
+	// Bundle in memory that must outlive the object
+	BasicExpressionBundle(const char *data, size_t size, const ExpressionParserSettings <T> &settings) :
+		m_settings(settings)
+	{
+		open(data, size);
+	}
+
+	BasicExpressionBundle(const BasicExpressionBundle&) = delete;
+	BasicExpressionBundle& operator=(const BasicExpressionBundle&) = delete;
+
+	size_t size() const
+	{
+		return m_size;
+	}
+	// Throws ExpressionException if i is out of range and ExpressionParserException if
+	// the expression is malformed
+	std::unique_ptr <BasicExpression <T> > load(size_t i) const
+	{
+		if(i >= m_size) {
+			throw ExpressionException("Index out of range");
+		}
+		uint64_t begin = offset(i), end = offset(i + 1);
+		// Expressions follow the table of offsets
+		if((begin < header_size + sizeof(uint64_t) * (m_size + 1)) || (end < begin) || (end > m_total)) {
+			throw ExpressionParserException("Malformed bundle");
+		}
+		return BasicExpression<T>::deserialize(m_data + begin, end - begin, m_settings);
+	}
+
+	// Writes expressions as a bundle, Ptr is a (smart) pointer to BasicExpression <T>
+	template <typename Ptr>
+	static void write(std::ostream &out, const std::vector <Ptr> &exprs)
+	{
+		std::string header, body;
+		BinaryWriter w(header);
+		w.write(BinaryFormat::bundle_magic);
+		w.write(BinaryFormat::version);
+		w.write(BinaryFormat::type<T>());
+		w.write(uint32_t(0));
+		w.write(static_cast<uint64_t>(exprs.size()));
+		uint64_t base = header.size() + sizeof(uint64_t) * (exprs.size() + 1);
+		for(const auto &i : exprs) {
+			w.write(base + body.size());
+			i->serialize(body);
+		}
+		w.write(base + body.size());
+		out.write(header.data(), header.size());
+		out.write(body.data(), body.size());
+	}
+private:
+	void open(const char *data, size_t size)
+	{
+		m_data = data;
+		BinaryReader in(data, size);
+		if(in.read<uint32_t>() != BinaryFormat::bundle_magic) {
+			throw ExpressionParserException("Not a bundle of binary expressions");
+		}
+		if(in.read<uint32_t>() != BinaryFormat::version) {
+			throw ExpressionParserException("Unsupported version of bundle");
+		}
+		if(in.read<uint32_t>() != BinaryFormat::type<T>()) {
+			throw ExpressionParserException("Bundle has different type of values");
+		}
+		in.read<uint32_t>();
+		uint64_t n = in.read<uint64_t>();
+		if(n >= in.left(sizeof(uint64_t))) {
+			throw ExpressionParserException("Truncated bundle");
+		}
+		m_size = static_cast<size_t>(n);
+		m_total = size;
+		m_offsets = data + header_size;
+	}
+	uint64_t offset(size_t i) const
+	{
+		uint64_t res;
+		std::memcpy(&res, m_offsets + sizeof(uint64_t) * i, sizeof(res));
+		return res;
+	}
+
+	static const size_t header_size = 4 * sizeof(uint32_t) + sizeof(uint64_t);
+
+	std::unique_ptr <MappedFile> m_file;
+	const ExpressionParserSettings <T> &m_settings;
+	const char *m_data;
+	// Size of the whole bundle
+	size_t m_total;
+	size_t m_size;
+	const char *m_offsets;
+};
+
+template <typename T>
+const size_t BasicExpressionBundle<T>::header_size;
+
+typedef BasicExpressionBundle <int> ExpressionBundle;
+typedef BasicExpressionBundle <int64_t> Int64ExpressionBundle;
+typedef BasicExpressionBundle <float> FloatExpressionBundle;
+typedef BasicExpressionBundle <double> DoubleExpressionBundle;
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef EXPRESSION_CACHE_H
+#define EXPRESSION_CACHE_H
+
+#include <cctype>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "expression.hpp"
+
+// Bounded cache of parsed expressions keyed by their source text with insignificant
+// whitespace removed (see normalize()). Cached expressions are immutable and shared, so
+// a hit costs normalization, a hash lookup and a copy of a shared pointer. When the cache
+// is full, the least recently used expression is evicted. Malformed strings aren't cached.
+// All methods are thread-safe; parsing on a miss is done without holding the lock.
+template <typename T>
+class BasicExpressionCache
+{
+public:
+	typedef std::shared_ptr <const BasicExpression <T> > Handle;
+
+	struct Stats
+	{
+		size_t hits;
+		size_t misses;
+		size_t evictions;
+	};
+
+	// Settings must outlive the cache and all expressions taken from it
+	explicit BasicExpressionCache(size_t capacity) :
+		BasicExpressionCache(capacity, BasicExpression<T>::defaultSettings())
+	{
+	}
+	BasicExpressionCache(size_t capacity, const ExpressionParserSettings <T> &settings) :
+		m_settings(settings), m_capacity(capacity), m_hits(0), m_misses(0), m_evictions(0)
+	{
+	}
+
+	BasicExpressionCache(const BasicExpressionCache&) = delete;
+	BasicExpressionCache& operator=(const BasicExpressionCache&) = delete;
+
+	// Throws ExpressionParserException if s is malformed
+	Handle get(const std::string &s)
+	{
+		ExpressionParserError error;
+		Handle res = tryGet(s, error);
+		if(error) {
+			// Parse once again just to get the exception with the full message
+			BasicExpression <T> e(s, m_settings);
+		}
+		return res;
+	}
+
+	// Returns null and sets error if s is malformed
+	Handle tryGet(const std::string &s, ExpressionParserError &error)
+	{
+		error = ExpressionParserError();
+		std::string key = normalize(s);
+		{
+			std::lock_guard <std::mutex> lock(m_mutex);
+			auto it = m_index.find(key);
+			if(it != m_index.end()) {
+				++m_hits;
+				m_entries.splice(m_entries.begin(), m_entries, it->second);
+				return it->second->second;
+			}
+			++m_misses;
+		}
+		// Original string is parsed, so that error offsets refer to it
+		ParserInput input(s);
+		Handle res(new BasicExpression <T>(input, m_settings, &error));
+		if(error) {
+			return nullptr;
+		}
+		std::lock_guard <std::mutex> lock(m_mutex);
+		auto it = m_index.find(key);
+		if(it != m_index.end()) {
+			// Another thread has parsed the same string meanwhile
+			m_entries.splice(m_entries.begin(), m_entries, it->second);
+			return it->second->second;
+		}
+		if(m_capacity == 0) {
+			return res;
+		}
+		if(m_entries.size() == m_capacity) {
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+			++m_evictions;
+		}
+		m_entries.push_front(std::make_pair(key, res));
+		m_index[key] = m_entries.begin();
+		return res;
+	}
+
+	Stats stats() const
+	{
+		std::lock_guard <std::mutex> lock(m_mutex);
+		Stats res;
+		res.hits = m_hits;
+		res.misses = m_misses;
+		res.evictions = m_evictions;
+		return res;
+	}
+	size_t size() const
+	{
+		std::lock_guard <std::mutex> lock(m_mutex);
+		return m_entries.size();
+	}
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+	// Drops all expressions, handles taken before stay valid
+	void clear()
+	{
+		std::lock_guard <std::mutex> lock(m_mutex);
+		m_index.clear();
+		m_entries.clear();
+	}
+
+	// Removes whitespace that doesn't separate tokens. A run of whitespace is kept as one
+	// space only between two characters of identifiers/numbers ("x y"), between two
+	// operator characters ("- -x") and after a possible beginning of an exponent ("2e -3",
+	// "2e- 3"), where removing it could change the tokens.
+	static std::string normalize(const std::string &s)
+	{
+		std::string res;
+		res.reserve(s.length());
+		bool space = false;
+		for(char c : s) {
+			if(isspace(static_cast<unsigned char>(c))) {
+				space = true;
+				continue;
+			}
+			if(space && !res.empty() && (((charClass(res.back()) == charClass(c))
+			                              && (charClass(c) != CharClass::SEPARATOR))
+			                             || endsWithExponent(res))) {
+				res += ' ';
+			}
+			space = false;
+			res += c;
+		}
+		return res;
+	}
+private:
+	enum class CharClass {WORD, SEPARATOR, OPERATOR};
+	static CharClass charClass(char c)
+	{
+		if(isalnum(static_cast<unsigned char>(c)) || (c == '_') || (c == '.')) {
+			return CharClass::WORD;
+		}
+		if((c == '(') || (c == ')') || (c == ',')) {
+			return CharClass::SEPARATOR;
+		}
+		return CharClass::OPERATOR;
+	}
+	// Whether s ends with a digit followed by an exponent marker and optionally by its sign,
+	// so that the following characters could continue the number (see matchNumber)
+	static bool endsWithExponent(const std::string &s)
+	{
+		size_t n = s.length();
+		if((n > 0) && ((s[n - 1] == '+') || (s[n - 1] == '-'))) {
+			--n;
+		}
+		return (n >= 2) && ((s[n - 1] == 'e') || (s[n - 1] == 'E'))
+		       && (isdigit(static_cast<unsigned char>(s[n - 2])) || (s[n - 2] == '.'));
+	}
+
+	typedef std::list <std::pair <std::string, Handle> > Entries;
+
+	const ExpressionParserSettings <T> &m_settings;
+	const size_t m_capacity;
+	mutable std::mutex m_mutex;
+	// Most recently used first
+	Entries m_entries;
+	std::unordered_map <std::string, typename Entries::iterator> m_index;
+	size_t m_hits;
+	size_t m_misses;
+	size_t m_evictions;
+};
+
+typedef BasicExpressionCache <int> ExpressionCache;
+
+#endif
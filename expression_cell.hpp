@@ -3,28 +3,49 @@
 
 #include "expression_base.hpp"
 
-#include <stack>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <iostream>
 
 using std::cout;
 using std::endl;
 
+template <typename T>
+class CellArena;
+
+// Cells don't own their arguments, all cells of a tree are owned by some CellArena.
+// None of the methods below is recursive, so depth of a tree is limited only by memory.
 template <typename T>
 struct Cell
 {
 	Cell();
-	Cell(const Cell &c);
-	~Cell();
+	Cell(const Cell &c) = delete;
 
-	Cell& operator=(const Cell &c);
+	Cell& operator=(const Cell &c) = delete;
+
+	// Deep copy of the subtree, all new cells are created in arena. Cells shared by several
+	// functions of the subtree (see ::hashCons) are copied once and stay shared in the copy.
+	Cell* clone(CellArena <T> &arena) const;
+	// Cells of the subtree in postorder, each shared cell is listed once
+	std::vector <Cell*> distinctCells();
 
 	bool operator<(const Cell &c) const;
+	// Cells with different hashes are rejected without looking at their arguments
 	bool operator==(const Cell &c) const;
 
 	void sort();
-	T eval(const std::map <std::string, T> &vars);
-	bool isSubExpression(std::vector <Cell*> &curcell, bool &subtree_match) const;
+	// vars[i] is the value of variable with id i
+	T eval(const T *vars);
+	// Checks whether some subtree of this tree is equal to c
+	bool isSubExpression(const Cell &c) const;
+
+	// Recomputes hashes of all cells of the subtree. It has to be called after any
+	// modification of the tree, except ones made by methods of this class and by the parser.
+	void updateHash();
+	// Recomputes hash of this cell only, assuming hashes of arguments are correct
+	void updateNodeHash();
 
 	void print() const;
 	void printNonRecursive() const;
@@ -38,38 +59,29 @@ struct Cell
 	struct
 	{
 		std::string name;
+		// Position of the variable in the list of variables of the expression
+		size_t id;
 	} var;
 	T val;
+	// Structural hash of the subtree, equal subtrees always have equal hashes
+	size_t hash;
 
+	// Visits cells of the subtree in postorder. Path from the root to the current cell is
+	// kept in one vector, so an end iterator doesn't allocate and copies are cheap.
 	class iterator
 	{
 	public:
-		iterator(const iterator &it) :
-			m_parents(it.m_parents),
-			m_arg_id(it.m_arg_id)
-		{
-		}
-		iterator& operator=(const iterator &it)
-		{
-			m_parents = it.m_parents;
-			m_arg_id = it.m_arg_id;
-			m_curcell = it.m_curcell;
-		}
 		iterator& operator++()
 		{
 			if(!m_parents.empty()) {
-				if((m_arg_id.top() + 1 < m_parents.top()->func.args.size())) {
-					++m_arg_id.top();
-					m_curcell = m_parents.top()->func.args[m_arg_id.top()];
-					while(m_curcell->type == Cell::Type::FUNCTION) {
-						m_parents.push(m_curcell);
-						m_arg_id.push(0);
-						m_curcell = m_curcell->func.args[0];
-					}
+				Frame &top = m_parents.back();
+				if(top.arg + 1 < top.cell->func.args.size()) {
+					++top.arg;
+					m_curcell = top.cell->func.args[top.arg];
+					descend();
 				} else {
-					m_curcell = m_parents.top();
-					m_parents.pop();
-					m_arg_id.pop();
+					m_curcell = top.cell;
+					m_parents.pop_back();
 				}
 			} else {
 				m_curcell = nullptr;
@@ -89,21 +101,30 @@ struct Cell
 			return m_curcell;
 		}
 	private:
-		iterator(Cell *cell)
+		iterator(Cell *cell) :
+			m_curcell(cell)
 		{
-			m_curcell = cell;
 			if(m_curcell != nullptr) {
-				while(m_curcell->type == Cell::Type::FUNCTION) {
-					m_parents.push(m_curcell);
-					m_arg_id.push(0);
-					m_curcell = m_curcell->func.args[0];
-				}
+				descend();
+			}
+		}
+		// Goes down to the first leaf of the current cell
+		void descend()
+		{
+			while(m_curcell->type == Cell::Type::FUNCTION) {
+				m_parents.push_back(Frame{m_curcell, 0});
+				m_curcell = m_curcell->func.args[0];
 			}
 		}
 		friend Cell;
 
-		std::stack <Cell <T>*> m_parents;
-		std::stack <int> m_arg_id;
+		struct Frame
+		{
+			Cell *cell;
+			// Position of the current child in arguments of cell
+			size_t arg;
+		};
+		std::vector <Frame> m_parents;
 		Cell *m_curcell;
 	};
 
@@ -115,52 +136,54 @@ struct Cell
 	{
 		return iterator(nullptr);
 	}
+
+protected:
+	struct PairHash
+	{
+		size_t operator()(const std::pair <const Cell*, const Cell*> &p) const
+		{
+			size_t res = std::hash <const void*>()(p.first);
+			hashCombine(res, std::hash <const void*>()(p.second));
+			return res;
+		}
+	};
+
+	// Copy of the cell without arguments
+	Cell* cloneNode(CellArena <T> &arena) const;
+	// Compares cells without arguments
+	bool equalNode(const Cell &c) const;
 };
 
 
 template <typename T>
 Cell<T>::Cell() :
-	type(Type::NONE)
-{
-}
-
-template <typename T>
-Cell<T>::Cell(const Cell &c)
+	type(Type::NONE),
+	hash(0)
 {
-	*this = c;
 }
 
 template <typename T>
-Cell<T>::~Cell()
+Cell<T>* Cell<T>::cloneNode(CellArena <T> &arena) const
 {
-	if(type == Type::FUNCTION) {
-		for(auto i : func.args) {
-			delete i;
-		}
-	}
-}
-
-template <typename T>
-Cell<T>& Cell<T>::operator=(const Cell &c)
-{
-	type = c.type;
+	Cell *res = arena.create();
+	res->type = type;
+	res->hash = hash;
 	switch(type) {
 	case Type::FUNCTION:
 	{
-		func.iter = c.func.iter;
-		for(auto i : c.func.args) {
-			func.args.push_back(new Cell(*i));
-		}
+		res->func.iter = func.iter;
+		res->func.args.reserve(func.args.size());
 		break;
 	}
 	case Type::VARIABLE:
 	{
-		var.name = c.var.name;
+		res->var.name = var.name;
+		res->var.id = var.id;
 		break;
 	}
 	case Type::CONSTANT:
 	{
-		val = c.val;
+		res->val = val;
 		break;
 	}
 	default:
@@ -168,7 +191,59 @@ Cell<T>& Cell<T>::operator=(const Cell &c)
 		break;
 	}
 	}
-	return *this;
+	return res;
+}
+
+template <typename T>
+Cell<T>* Cell<T>::clone(CellArena <T> &arena) const
+{
+	Cell *res = cloneNode(arena);
+	// Copy of each already copied cell
+	std::unordered_map <const Cell*, Cell*> copies;
+	copies[this] = res;
+	// Pairs of original cell and its copy, arguments of the copy haven't been created yet
+	std::vector <std::pair <const Cell*, Cell*> > cells;
+	cells.push_back(std::make_pair(this, res));
+	while(!cells.empty()) {
+		auto c = cells.back();
+		cells.pop_back();
+		if(c.first->type == Type::FUNCTION) {
+			for(auto i : c.first->func.args) {
+				auto it = copies.find(i);
+				if(it == copies.end()) {
+					it = copies.insert(std::make_pair(i, i->cloneNode(arena))).first;
+					cells.push_back(*it);
+				}
+				c.second->func.args.push_back(it->second);
+			}
+		}
+	}
+	return res;
+}
+
+template <typename T>
+std::vector <Cell<T>*> Cell<T>::distinctCells()
+{
+	std::vector <Cell*> res;
+	std::unordered_set <const Cell*> visited;
+	visited.insert(this);
+	// Each element is a cell and the number of its already visited arguments
+	std::vector <std::pair <Cell*, size_t> > cells;
+	cells.push_back(std::make_pair(this, 0));
+	while(!cells.empty()) {
+		Cell *cell = cells.back().first;
+		size_t &arg = cells.back().second;
+		if((cell->type == Type::FUNCTION) && (arg < cell->func.args.size())) {
+			Cell *c = cell->func.args[arg++];
+			if(visited.insert(c).second) {
+				cells.push_back(std::make_pair(c, 0));
+			}
+			continue;
+		}
+		cells.pop_back();
+		res.push_back(cell);
+	}
+	return res;
 }
 
 template <typename T>
@@ -190,16 +265,10 @@ bool Cell<T>::operator<(const Cell &c) const
 }
 
 template <typename T>
-bool Cell<T>::operator==(const Cell &c) const
+bool Cell<T>::equalNode(const Cell &c) const
 {
-	if((type == Type::FUNCTION) && (c.type == Type::FUNCTION) && (func.iter == c.func.iter)) {
-		bool ok = true;
-		for(size_t i = 0; i < func.args.size(); ++i) {
-			if(!(*func.args[i] == *c.func.args[i])) {
-				ok = false;
-			}
-		}
-		return ok;
+	if((type == Type::FUNCTION) && (c.type == Type::FUNCTION)) {
+		return (func.iter == c.func.iter) && (func.args.size() == c.func.args.size());
 	} else if((type == Type::VARIABLE) && (c.type == Type::VARIABLE)) {
 		return var.name == c.var.name;
 	} else if((type == Type::CONSTANT) && (c.type == Type::CONSTANT)) {
@@ -210,115 +279,175 @@ bool Cell<T>::operator==(const Cell &c) const
 }
 
 template <typename T>
-T Cell<T>::eval(const std::map <std::string, T> &vars)
+bool Cell<T>::operator==(const Cell &c) const
 {
-	switch(type) {
-	case Type::FUNCTION:
-	{
-		Args <T> args;
-		for(auto i : func.args) {
-			args.push_back(i->eval(vars));
+	std::vector <std::pair <const Cell*, const Cell*> > cells;
+	// Pairs of function cells that are already compared, so that shared cells of DAGs are
+	// compared once instead of once for every path to them
+	std::unordered_set <std::pair <const Cell*, const Cell*>, PairHash> visited;
+	cells.push_back(std::make_pair(this, &c));
+	while(!cells.empty()) {
+		auto p = cells.back();
+		cells.pop_back();
+		if(p.first == p.second) {
+			continue;
+		}
+		if((p.first->hash != p.second->hash) || !p.first->equalNode(*p.second)) {
+			return false;
+		}
+		if((p.first->type == Type::FUNCTION) && visited.insert(p).second) {
+			for(size_t i = 0; i < p.first->func.args.size(); ++i) {
+				cells.push_back(std::make_pair(p.first->func.args[i], p.second->func.args[i]));
+			}
 		}
-		return func.iter->func(args);
-	}
-	case Type::VARIABLE:
-	{
-		auto it = vars.find(var.name);
-		return it->second;
-	}
-	case Type::CONSTANT:
-	{
-		return val;
-	}
-	default:
-		throw ExpressionParserException("Attempt to evaluate cell of type \"NONE\"");
 	}
+	return true;
 }
 
 template <typename T>
-bool Cell<T>::isSubExpression(std::vector <Cell*> &curcell, bool &subtree_match) const
+T Cell<T>::eval(const T *vars)
 {
-	// Invariant relation:
-	// curcell - path from root to one of the leaves in a assumed subtree that
-	// hasn't been matched yet
-	if(type == Type::FUNCTION) {
-		bool tsm;
-		subtree_match = true;
-		for(size_t i = 0; i < func.iter->args_num; ++i) {
-			if(func.args[i]->isSubExpression(curcell, tsm)) {
-				return true;
+	// Cells are visited in postorder, so values of arguments are always on top of the stack
+	std::vector <T> values;
+	Args <T> args;
+	for(auto it = begin(); it != end(); ++it) {
+		switch(it->type) {
+		case Type::FUNCTION:
+		{
+			const Function <T> &f = *it->func.iter;
+			if(f.unary != nullptr) {
+				values.back() = f.unary(values.back());
+				break;
 			}
-			subtree_match &= tsm;
-			// It's possible that recursive call has changed value of curcell, so we have
-			// to restore it (i.e. push necessary arguments)
-			auto cell = curcell[curcell.size() - 1];
-			if((cell->type == Type::FUNCTION) && (i + 1 < func.iter->args_num)) {
-				if(func.iter != cell->func.iter) {
-					subtree_match = false;
-				} else {
-					curcell.push_back(cell->func.args[i + 1]);
-					while(curcell[curcell.size() - 1]->type == Cell<T>::Type::FUNCTION) {
-						curcell.push_back(curcell[curcell.size() - 1]->func.args[0]);
-					}
-
-				}
+			if(f.binary != nullptr) {
+				T b = values.back();
+				values.pop_back();
+				values.back() = f.binary(values.back(), b);
+				break;
 			}
+			size_t n = it->func.args.size();
+			args.assign(values.end() - n, values.end());
+			values.resize(values.size() - n);
+			values.push_back(f.func(args));
+			break;
 		}
-		auto cell = curcell[curcell.size() - 1];
-		if(subtree_match && (func.iter == cell->func.iter)) {
-			curcell.pop_back();
-			return (curcell.size() == 0);
-		} else {
-			subtree_match = false;
-			while(cell->type == Cell<T>::Type::FUNCTION) {
-				curcell.push_back(cell = cell->func.args[0]);
-			}
-			return false;
+		case Type::VARIABLE:
+		{
+			values.push_back(vars[it->var.id]);
+			break;
 		}
-	} else if(curcell.size() > 1) {
-		subtree_match = (*this == *curcell[curcell.size() - 1]);
-		if(subtree_match) {
-			curcell.pop_back();
+		case Type::CONSTANT:
+		{
+			values.push_back(it->val);
+			break;
 		}
-		return false;
-	} else {
-		subtree_match = (*this == *curcell[0]);
-		if(subtree_match) {
-			curcell.pop_back();
+		default:
+			throw ExpressionParserException("Attempt to evaluate cell of type \"NONE\"");
+		}
+	}
+	return values.back();
+}
+
+template <typename T>
+bool Cell<T>::isSubExpression(const Cell &c) const
+{
+	std::vector <const Cell*> cells;
+	// Each shared cell is checked once
+	std::unordered_set <const Cell*> visited;
+	cells.push_back(this);
+	visited.insert(this);
+	while(!cells.empty()) {
+		const Cell *cell = cells.back();
+		cells.pop_back();
+		if((cell->hash == c.hash) && (*cell == c)) {
+			return true;
+		}
+		if(cell->type == Type::FUNCTION) {
+			for(auto i : cell->func.args) {
+				if(visited.insert(i).second) {
+					cells.push_back(i);
+				}
+			}
 		}
-		return subtree_match;
 	}
+	return false;
 }
 
 template <typename T>
 void Cell<T>::sort()
 {
-	if(type == Type::FUNCTION) {
-		auto f = func.iter;
-		if((f->args_num == 2) && f->is_commutative && (*func.args[1] < *func.args[0])) {
-			std::swap(func.args[0], func.args[1]);
+	// Arguments precede their functions, so hashes of arguments are already updated
+	for(auto cell : distinctCells()) {
+		if(cell->type == Type::FUNCTION) {
+			auto f = cell->func.iter;
+			auto &args = cell->func.args;
+			if((f->args_num == 2) && f->is_commutative && (*args[1] < *args[0])) {
+				std::swap(args[0], args[1]);
+			}
 		}
+		cell->updateNodeHash();
+	}
+}
+
+template <typename T>
+void Cell<T>::updateNodeHash()
+{
+	hash = static_cast<size_t>(type);
+	switch(type) {
+	case Type::FUNCTION:
+		hashCombine(hash, std::hash <const void*>()(&*func.iter));
 		for(auto i : func.args) {
-			i->sort();
+			hashCombine(hash, i->hash);
 		}
+		break;
+	case Type::VARIABLE:
+		hashCombine(hash, std::hash <std::string>()(var.name));
+		break;
+	case Type::CONSTANT:
+		hashCombine(hash, std::hash <T>()(val));
+		break;
+	default:
+		break;
+	}
+}
+
+template <typename T>
+void Cell<T>::updateHash()
+{
+	for(auto it = begin(); it != end(); ++it) {
+		it->updateNodeHash();
 	}
 }
 
 template <typename T>
 void Cell<T>::print() const
 {
-	if(type == Type::FUNCTION) {
-		cout << "(";
-		cout << func.iter->name;
-		for(const auto &i : func.args) {
-			cout << " ";
-			i->print();
+	// Each element is a function cell and the number of its already printed arguments
+	std::vector <std::pair <const Cell*, size_t> > cells;
+	cells.push_back(std::make_pair(this, 0));
+	while(!cells.empty()) {
+		const Cell *cell = cells.back().first;
+		if(cell->type == Type::VARIABLE) {
+			cout << cell->var.name;
+			cells.pop_back();
+		} else if(cell->type == Type::CONSTANT) {
+			cout << cell->val;
+			cells.pop_back();
+		} else if(cell->type != Type::FUNCTION) {
+			cells.pop_back();
+		} else {
+			size_t &arg = cells.back().second;
+			if(arg == 0) {
+				cout << "(" << cell->func.iter->name;
+			}
+			if(arg < cell->func.args.size()) {
+				cout << " ";
+				cells.push_back(std::make_pair(cell->func.args[arg++], 0));
+			} else {
+				cout << ")";
+				cells.pop_back();
+			}
 		}
-		cout << ")";
-	} else if(type == Type::VARIABLE) {
-		cout << var.name;
-	} else if(type == Type::CONSTANT) {
-		cout << val;
 	}
 }
 
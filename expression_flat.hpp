@@ -0,0 +1,306 @@
+#ifndef EXPRESSION_FLAT_H
+#define EXPRESSION_FLAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "expression_base.hpp"
+#include "expression_cell.hpp"
+#include "expression_arena.hpp"
+
+// Read-only copy of a tree as one contiguous array of nodes in postorder: arguments always
+// precede their functions and the root is the last node. Nodes refer to their arguments by
+// 32-bit indices, so walking the tree is a linear scan over the array without pointer
+// chasing. A function shared by several parents (see hashCons) becomes one node. Compiled
+// forms of expressions (Program, IncrementalEvaluator, GradientTape, binary format) are
+// built from it. It's also the stored form of compiled expressions: a node takes 12 bytes
+// and 4 per argument instead of a cell with a name and a vector of arguments, and cells
+// are built back from it (see cells()) only when the expression is modified or inspected.
+template <typename T>
+class FlatTree
+{
+public:
+	// Same order as Cell::Type
+	enum class Kind : uint8_t {FUNCTION, CONSTANT, VARIABLE};
+
+	struct Node
+	{
+		Kind kind() const
+		{
+			return static_cast<Kind>(tag & 3);
+		}
+		uint32_t argsNum() const
+		{
+			return tag >> 2;
+		}
+
+		// Kind in the low 2 bits, number of arguments in the rest
+		uint32_t tag;
+		// Index in functions() for functions, variable id for variables, index in
+		// constants() for constants
+		uint32_t data;
+		// Index of the first argument in args()
+		uint32_t args;
+	};
+
+	void build(const Cell <T> *root);
+	// Builds cells of the tree in arena and returns the root, names[i] is the name of
+	// variable with id i. Each node becomes one cell, so shared nodes stay shared.
+	Cell <T>* cells(CellArena <T> &arena, const std::vector <std::string> &names) const;
+
+	// Builders of the tree without cells (e.g. from binary format). Nodes are added in
+	// postorder, arguments of a node have to be added before it. Returns index of f in
+	// functions(), f is added if it isn't there yet.
+	uint32_t addFunction(typename Functions<T>::const_iterator f);
+	// Adds node of function with index f and arguments args[0, n)
+	void pushFunction(uint32_t f, const uint32_t *args, uint32_t n);
+	void pushVariable(uint32_t id);
+	void pushConstant(T val);
+	void reserve(size_t nodes, size_t args)
+	{
+		m_nodes.reserve(nodes);
+		m_args.reserve(args);
+	}
+
+	void clear()
+	{
+		m_nodes.clear();
+		m_args.clear();
+		m_functions.clear();
+		m_iters.clear();
+		m_constants.clear();
+	}
+
+	bool empty() const
+	{
+		return m_nodes.empty();
+	}
+	size_t size() const
+	{
+		return m_nodes.size();
+	}
+	const Node& operator[](size_t i) const
+	{
+		return m_nodes[i];
+	}
+	const std::vector <Node>& nodes() const
+	{
+		return m_nodes;
+	}
+	// Indices of arguments of all nodes, arguments of a node are args()[node.args, node.args + node.argsNum())
+	const std::vector <uint32_t>& args() const
+	{
+		return m_args;
+	}
+	// Distinct functions of the tree
+	const std::vector <const Function <T>*>& functions() const
+	{
+		return m_functions;
+	}
+	const std::vector <T>& constants() const
+	{
+		return m_constants;
+	}
+
+	const Function <T>& function(const Node &node) const
+	{
+		return *m_functions[node.data];
+	}
+	const uint32_t* argsOf(const Node &node) const
+	{
+		return m_args.data() + node.args;
+	}
+
+	// Value of the function of the node for values[i] being the value of node i.
+	// buf is used for functions called with a vector of arguments.
+	T apply(const Node &node, const T *values, Args <T> &buf) const;
+private:
+	std::vector <Node> m_nodes;
+	std::vector <uint32_t> m_args;
+	std::vector <const Function <T>*> m_functions;
+	// Positions of m_functions in the grammar, needed to build cells
+	std::vector <typename Functions<T>::const_iterator> m_iters;
+	std::vector <T> m_constants;
+};
+
+template <typename T>
+void FlatTree<T>::build(const Cell <T> *root)
+{
+	clear();
+	if(root == nullptr) {
+		return;
+	}
+	// Indices of already added function cells
+	std::unordered_map <const Cell <T>*, uint32_t> ids;
+	// Each element is a cell and the number of its already visited arguments
+	std::vector <std::pair <const Cell <T>*, size_t> > stack;
+	// Indices of added nodes whose parents aren't added yet, the last one is on top
+	std::vector <uint32_t> done;
+	stack.push_back(std::make_pair(root, 0));
+	while(!stack.empty()) {
+		const Cell <T> *cell = stack.back().first;
+		size_t &arg = stack.back().second;
+		if((cell->type == Cell<T>::Type::FUNCTION) && (arg < cell->func.args.size())) {
+			const Cell <T> *c = cell->func.args[arg++];
+			auto it = ids.find(c);
+			if(it != ids.end()) {
+				done.push_back(it->second);
+			} else {
+				stack.push_back(std::make_pair(c, 0));
+			}
+			continue;
+		}
+		stack.pop_back();
+		uint32_t id = static_cast<uint32_t>(m_nodes.size());
+		switch(cell->type) {
+		case Cell<T>::Type::FUNCTION:
+		{
+			uint32_t n = static_cast<uint32_t>(cell->func.args.size());
+			pushFunction(addFunction(cell->func.iter), done.data() + done.size() - n, n);
+			done.resize(done.size() - n);
+			break;
+		}
+		case Cell<T>::Type::VARIABLE:
+			pushVariable(static_cast<uint32_t>(cell->var.id));
+			break;
+		case Cell<T>::Type::CONSTANT:
+			pushConstant(cell->val);
+			break;
+		default:
+			throw ExpressionParserException("Attempt to compile cell of type \"NONE\"");
+		}
+		done.push_back(id);
+		// Function cells may be reached again through another parent, shared leaves are
+		// just duplicated
+		if(cell->type == Cell<T>::Type::FUNCTION) {
+			ids[cell] = id;
+		}
+	}
+}
+
+template <typename T>
+Cell <T>* FlatTree<T>::cells(CellArena <T> &arena, const std::vector <std::string> &names) const
+{
+	if(m_nodes.empty()) {
+		return nullptr;
+	}
+	arena.reserve(m_nodes.size());
+	std::vector <Cell <T>*> res(m_nodes.size());
+	for(size_t i = 0; i < m_nodes.size(); ++i) {
+		const Node &node = m_nodes[i];
+		Cell <T> *cell = arena.create();
+		switch(node.kind()) {
+		case Kind::FUNCTION:
+			cell->type = Cell<T>::Type::FUNCTION;
+			cell->func.iter = m_iters[node.data];
+			cell->func.args.resize(node.argsNum());
+			for(uint32_t k = 0; k < node.argsNum(); ++k) {
+				cell->func.args[k] = res[argsOf(node)[k]];
+			}
+			break;
+		case Kind::VARIABLE:
+			cell->type = Cell<T>::Type::VARIABLE;
+			cell->var.id = node.data;
+			cell->var.name = names[node.data];
+			break;
+		case Kind::CONSTANT:
+			cell->type = Cell<T>::Type::CONSTANT;
+			cell->val = m_constants[node.data];
+			break;
+		}
+		// Arguments precede their functions, so their hashes are already known
+		cell->updateNodeHash();
+		res[i] = cell;
+	}
+	return res.back();
+}
+
+template <typename T>
+uint32_t FlatTree<T>::addFunction(typename Functions<T>::const_iterator f)
+{
+	// Trees use only a few distinct functions, so a linear search is enough
+	auto it = std::find(m_functions.begin(), m_functions.end(), &*f);
+	if(it == m_functions.end()) {
+		m_functions.push_back(&*f);
+		m_iters.push_back(f);
+		return static_cast<uint32_t>(m_functions.size() - 1);
+	}
+	return static_cast<uint32_t>(it - m_functions.begin());
+}
+
+template <typename T>
+void FlatTree<T>::pushFunction(uint32_t f, const uint32_t *args, uint32_t n)
+{
+	Node node;
+	node.tag = static_cast<uint32_t>(Kind::FUNCTION) | (n << 2);
+	node.data = f;
+	node.args = static_cast<uint32_t>(m_args.size());
+	m_args.insert(m_args.end(), args, args + n);
+	m_nodes.push_back(node);
+}
+
+template <typename T>
+void FlatTree<T>::pushVariable(uint32_t id)
+{
+	Node node;
+	node.tag = static_cast<uint32_t>(Kind::VARIABLE);
+	node.data = id;
+	node.args = static_cast<uint32_t>(m_args.size());
+	m_nodes.push_back(node);
+}
+
+template <typename T>
+void FlatTree<T>::pushConstant(T val)
+{
+	Node node;
+	node.tag = static_cast<uint32_t>(Kind::CONSTANT);
+	node.data = static_cast<uint32_t>(m_constants.size());
+	node.args = static_cast<uint32_t>(m_args.size());
+	m_constants.push_back(val);
+	m_nodes.push_back(node);
+}
+
+template <typename T>
+T FlatTree<T>::apply(const Node &node, const T *values, Args <T> &buf) const
+{
+	typedef typename Function<T>::Builtin Builtin;
+	const uint32_t *a = argsOf(node);
+	const Function <T> &f = function(node);
+	switch(f.builtin) {
+	case Builtin::ADD:
+		return values[a[0]] + values[a[1]];
+	case Builtin::SUB:
+		return values[a[0]] - values[a[1]];
+	case Builtin::MUL:
+		return values[a[0]] * values[a[1]];
+	case Builtin::DIV:
+		return values[a[0]] / values[a[1]];
+	case Builtin::NEG:
+		return -values[a[0]];
+	case Builtin::ABS:
+		return std::abs(values[a[0]]);
+	case Builtin::MIN:
+		return std::min(values[a[0]], values[a[1]]);
+	case Builtin::MAX:
+		return std::max(values[a[0]], values[a[1]]);
+	default:
+		break;
+	}
+	if(f.unary != nullptr) {
+		return f.unary(values[a[0]]);
+	}
+	if(f.binary != nullptr) {
+		return f.binary(values[a[0]], values[a[1]]);
+	}
+	buf.resize(node.argsNum());
+	for(uint32_t i = 0; i < node.argsNum(); ++i) {
+		buf[i] = values[a[i]];
+	}
+	return f.func(buf);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef EXPRESSION_GRADIENT_H
+#define EXPRESSION_GRADIENT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "expression_base.hpp"
+#include "expression_flat.hpp"
+
+// Reverse-mode differentiation of a tree. The forward pass records the value of every cell,
+// the backward pass goes over the cells in reverse order and accumulates derivatives of the
+// result by each cell (adjoints), so the whole gradient costs about two evaluations
+// regardless of the number of variables. Shared cells (see hashCons) are recorded once.
+template <typename T>
+class GradientTape
+{
+public:
+	GradientTape() :
+		m_vars(0)
+	{
+	}
+
+	void compile(const std::shared_ptr <const FlatTree <T> > &tree, size_t vars);
+	bool empty() const
+	{
+		return !m_tree;
+	}
+	void clear()
+	{
+		m_tree.reset();
+		m_values.clear();
+		m_adj.clear();
+	}
+	// Some function of the tree without derivative rule or nullptr if there is none
+	const Function <T>* undifferentiable() const;
+
+	// vars[i] is the value of variable with id i, grad[i] is set to the derivative of the
+	// result by variable with id i
+	T eval(const T *vars, T *grad);
+protected:
+	typedef typename FlatTree<T>::Kind Kind;
+	typedef typename FlatTree<T>::Node Node;
+
+	// Adds adj * d(node)/d(argument) to adjoints of arguments
+	void backward(uint32_t id, T adj);
+
+	// Shared with the expression, see BasicExpression::compile
+	std::shared_ptr <const FlatTree <T> > m_tree;
+	size_t m_vars;
+	// Values and adjoints of nodes of m_tree
+	std::vector <T> m_values;
+	std::vector <T> m_adj;
+	Args <T> m_buf;
+	Args <T> m_partials;
+};
+
+template <typename T>
+void GradientTape<T>::compile(const std::shared_ptr <const FlatTree <T> > &tree, size_t vars)
+{
+	m_tree = tree;
+	m_vars = vars;
+	m_values.resize(m_tree->size());
+	m_adj.resize(m_tree->size());
+}
+
+template <typename T>
+const Function <T>* GradientTape<T>::undifferentiable() const
+{
+	for(auto i : m_tree->functions()) {
+		if((i->builtin == Function<T>::Builtin::NONE) && !i->derivative) {
+			return i;
+		}
+	}
+	return nullptr;
+}
+
+template <typename T>
+T GradientTape<T>::eval(const T *vars, T *grad)
+{
+	for(uint32_t i = 0; i < m_tree->size(); ++i) {
+		const Node &node = (*m_tree)[i];
+		switch(node.kind()) {
+		case Kind::FUNCTION:
+			m_values[i] = m_tree->apply(node, m_values.data(), m_buf);
+			break;
+		case Kind::VARIABLE:
+			m_values[i] = vars[node.data];
+			break;
+		case Kind::CONSTANT:
+			m_values[i] = m_tree->constants()[node.data];
+			break;
+		}
+	}
+	std::fill(grad, grad + m_vars, T());
+	std::fill(m_adj.begin(), m_adj.end(), T());
+	m_adj.back() = T(1);
+	for(size_t i = m_tree->size(); i-- > 0;) {
+		const Node &node = (*m_tree)[i];
+		if(node.kind() == Kind::FUNCTION) {
+			backward(static_cast<uint32_t>(i), m_adj[i]);
+		} else if(node.kind() == Kind::VARIABLE) {
+			grad[node.data] += m_adj[i];
+		}
+	}
+	return m_values.back();
+}
+
+template <typename T>
+void GradientTape<T>::backward(uint32_t id, T adj)
+{
+	const Node &node = (*m_tree)[id];
+	const uint32_t *a = m_tree->argsOf(node);
+	const Function <T> &f = m_tree->function(node);
+	const T *v = m_values.data();
+	switch(f.builtin) {
+	case Function<T>::Builtin::ADD:
+		m_adj[a[0]] += adj;
+		m_adj[a[1]] += adj;
+		return;
+	case Function<T>::Builtin::SUB:
+		m_adj[a[0]] += adj;
+		m_adj[a[1]] -= adj;
+		return;
+	case Function<T>::Builtin::MUL:
+		m_adj[a[0]] += adj * v[a[1]];
+		m_adj[a[1]] += adj * v[a[0]];
+		return;
+	case Function<T>::Builtin::DIV:
+		// d(x / y)/dy = -(x / y) / y
+		m_adj[a[0]] += adj / v[a[1]];
+		m_adj[a[1]] -= adj * v[id] / v[a[1]];
+		return;
+	case Function<T>::Builtin::NEG:
+		m_adj[a[0]] -= adj;
+		return;
+	case Function<T>::Builtin::ABS:
+		if(v[a[0]] < T()) {
+			m_adj[a[0]] -= adj;
+		} else if(v[a[0]] > T()) {
+			m_adj[a[0]] += adj;
+		}
+		return;
+	case Function<T>::Builtin::MIN:
+	case Function<T>::Builtin::MAX:
+		// Derivative goes to the chosen argument, to the first one on ties
+		m_adj[a[(v[id] == v[a[0]]) ? 0 : 1]] += adj;
+		return;
+	default:
+		break;
+	}
+	m_buf.resize(node.argsNum());
+	for(uint32_t i = 0; i < node.argsNum(); ++i) {
+		m_buf[i] = v[a[i]];
+	}
+	m_partials.assign(node.argsNum(), T());
+	f.derivative(m_buf, v[id], m_partials);
+	for(uint32_t i = 0; i < node.argsNum(); ++i) {
+		m_adj[a[i]] += adj * m_partials[i];
+	}
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef EXPRESSION_INCREMENTAL_H
+#define EXPRESSION_INCREMENTAL_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "expression_base.hpp"
+#include "expression_flat.hpp"
+
+// Evaluator that keeps the last value of every cell and recomputes only cells depending
+// on variables changed since the previous evaluation. A cell is recomputed only if some
+// of its arguments actually changed, so a change stops propagating as soon as a value
+// stays the same (e.g. max(x, 100) for small x). Shared cells (see hashCons) are
+// evaluated once.
+template <typename T>
+class IncrementalEvaluator
+{
+public:
+	IncrementalEvaluator() :
+		m_valid(false),
+		m_recomputed(0)
+	{
+	}
+
+	// values[i] is the initial value of variable with id i
+	void compile(const std::shared_ptr <const FlatTree <T> > &tree, const std::vector <T> &values);
+	// Does nothing if the value is the same
+	void setVar(size_t id, T val);
+	T eval();
+
+	// Number of cells recomputed by the last eval()
+	size_t recomputed() const
+	{
+		return m_recomputed;
+	}
+protected:
+	void push(uint32_t id)
+	{
+		if(!m_queued[id]) {
+			m_queued[id] = true;
+			m_queue.push(id);
+		}
+	}
+	void pushParents(uint32_t id)
+	{
+		for(uint32_t i = m_parents_begin[id]; i < m_parents_begin[id + 1]; ++i) {
+			push(m_parents[i]);
+		}
+	}
+
+	// Shared with the expression, see BasicExpression::compile
+	std::shared_ptr <const FlatTree <T> > m_tree;
+	// Last values of nodes of m_tree
+	std::vector <T> m_values;
+	// Parents of node i are m_parents[m_parents_begin[i], m_parents_begin[i + 1])
+	std::vector <uint32_t> m_parents;
+	std::vector <uint32_t> m_parents_begin;
+	// Variable nodes of each variable
+	std::vector <std::vector <uint32_t> > m_var_nodes;
+	// Nodes to recompute, the smallest id first, so arguments are always ready
+	std::priority_queue <uint32_t, std::vector <uint32_t>, std::greater <uint32_t> > m_queue;
+	// Whether each node is in m_queue
+	std::vector <bool> m_queued;
+	// Whether node values are valid, otherwise everything is recomputed
+	bool m_valid;
+	size_t m_recomputed;
+	Args <T> m_buf;
+};
+
+template <typename T>
+void IncrementalEvaluator<T>::compile(const std::shared_ptr <const FlatTree <T> > &tree,
+                                      const std::vector <T> &values)
+{
+	typedef typename FlatTree<T>::Kind Kind;
+	m_tree = tree;
+	size_t n = m_tree->size();
+	m_values.assign(n, T());
+	m_var_nodes.assign(values.size(), std::vector <uint32_t>());
+	m_queue = decltype(m_queue)();
+	m_queued.assign(n, false);
+	m_valid = false;
+	m_recomputed = 0;
+
+	for(uint32_t i = 0; i < n; ++i) {
+		const auto &node = (*m_tree)[i];
+		if(node.kind() == Kind::VARIABLE) {
+			m_values[i] = values[node.data];
+			m_var_nodes[node.data].push_back(i);
+		} else if(node.kind() == Kind::CONSTANT) {
+			m_values[i] = m_tree->constants()[node.data];
+		}
+	}
+
+	// Parents are found by inverting arguments
+	m_parents_begin.assign(n + 1, 0);
+	for(auto a : m_tree->args()) {
+		++m_parents_begin[a + 1];
+	}
+	for(size_t i = 0; i < n; ++i) {
+		m_parents_begin[i + 1] += m_parents_begin[i];
+	}
+	m_parents.resize(m_tree->args().size());
+	std::vector <uint32_t> filled(m_parents_begin.begin(), m_parents_begin.end() - 1);
+	for(uint32_t i = 0; i < n; ++i) {
+		const auto &node = (*m_tree)[i];
+		for(uint32_t k = 0; k < node.argsNum(); ++k) {
+			m_parents[filled[m_tree->argsOf(node)[k]]++] = i;
+		}
+	}
+}
+
+template <typename T>
+void IncrementalEvaluator<T>::setVar(size_t id, T val)
+{
+	for(auto i : m_var_nodes[id]) {
+		if(m_values[i] != val) {
+			m_values[i] = val;
+			if(m_valid) {
+				pushParents(i);
+			}
+		}
+	}
+}
+
+template <typename T>
+T IncrementalEvaluator<T>::eval()
+{
+	typedef typename FlatTree<T>::Kind Kind;
+	m_recomputed = 0;
+	if(!m_valid) {
+		for(uint32_t i = 0; i < m_tree->size(); ++i) {
+			if((*m_tree)[i].kind() == Kind::FUNCTION) {
+				m_values[i] = m_tree->apply((*m_tree)[i], m_values.data(), m_buf);
+				++m_recomputed;
+			}
+		}
+		m_valid = true;
+		m_queue = decltype(m_queue)();
+		m_queued.assign(m_tree->size(), false);
+		return m_values.back();
+	}
+	while(!m_queue.empty()) {
+		uint32_t i = m_queue.top();
+		// If apply() throws, the node stays in the queue for the next eval()
+		T val = m_tree->apply((*m_tree)[i], m_values.data(), m_buf);
+		++m_recomputed;
+		m_queue.pop();
+		m_queued[i] = false;
+		if(!(val == m_values[i])) {
+			m_values[i] = val;
+			pushParents(i);
+		}
+	}
+	return m_values.back();
+}
+
+#endif
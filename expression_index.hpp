@@ -0,0 +1,125 @@
+#ifndef EXPRESSION_INDEX_H
+#define EXPRESSION_INDEX_H
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <typename T>
+struct Function;
+
+// Prefix tree over names of functions from some collection. It's built once together
+// with the grammar and allows finding the longest function name at the given position of
+// the input without scanning the whole collection and without any allocations.
+// Functions are identified by their positions in the collection, so the index stays valid
+// for copies of the collection.
+template <typename T>
+class FunctionIndex
+{
+public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	FunctionIndex() :
+		m_nodes(1)
+	{
+	}
+
+	explicit FunctionIndex(const std::vector <Function <T> > &coll) :
+		m_nodes(1)
+	{
+		for(size_t i = 0; i < coll.size(); ++i) {
+			insert(coll[i].name, coll[i].type, i);
+		}
+	}
+
+	// Returns position of the function with the longest name that is a prefix of input[id..].
+	// Type NONE matches functions of any type. Input is a ParserInput.
+	template <typename Input>
+	size_t longestMatch(Input &input, size_t id,
+	                    typename Function<T>::Type type = Function<T>::Type::NONE) const
+	{
+		size_t res = npos;
+		size_t node = 0;
+		for(; input.has(id); ++id) {
+			node = child(node, input[id]);
+			if(node == npos) {
+				break;
+			}
+			size_t item = m_nodes[node].item(type);
+			if(item != npos) {
+				res = item;
+			}
+		}
+		return res;
+	}
+
+	// Returns position of the function with exactly this name and type
+	size_t find(const std::string &name, typename Function<T>::Type type) const
+	{
+		size_t node = 0;
+		for(size_t i = 0; (i < name.length()) && (node != npos); ++i) {
+			node = child(node, name[i]);
+		}
+		return (node == npos) ? npos : m_nodes[node].item(type);
+	}
+
+private:
+	struct Node
+	{
+		Node() :
+			any(npos)
+		{
+			for(auto &i : items) {
+				i = npos;
+			}
+		}
+		size_t item(typename Function<T>::Type type) const
+		{
+			return (type == Function<T>::Type::NONE) ? any : items[static_cast<size_t>(type)];
+		}
+		// Sorted by character
+		std::vector <std::pair <char, size_t> > children;
+		// First function of each type whose name ends in this node
+		size_t items[static_cast<size_t>(Function<T>::Type::NONE) + 1];
+		// First function of any type whose name ends in this node
+		size_t any;
+	};
+
+	size_t child(size_t node, char c) const
+	{
+		const auto &ch = m_nodes[node].children;
+		auto it = std::lower_bound(ch.begin(), ch.end(), std::make_pair(c, size_t(0)));
+		return ((it != ch.end()) && (it->first == c)) ? it->second : npos;
+	}
+
+	void insert(const std::string &name, typename Function<T>::Type type, size_t id)
+	{
+		size_t node = 0;
+		for(char c : name) {
+			size_t next = child(node, c);
+			if(next == npos) {
+				next = m_nodes.size();
+				m_nodes.push_back(Node());
+				auto &ch = m_nodes[node].children;
+				ch.insert(std::lower_bound(ch.begin(), ch.end(), std::make_pair(c, size_t(0))),
+				          std::make_pair(c, next));
+			}
+			node = next;
+		}
+		size_t &item = m_nodes[node].items[static_cast<size_t>(type)];
+		if(item == npos) {
+			item = id;
+		}
+		if(m_nodes[node].any == npos) {
+			m_nodes[node].any = id;
+		}
+	}
+
+	std::vector <Node> m_nodes;
+};
+
+template <typename T>
+const size_t FunctionIndex<T>::npos;
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef EXPRESSION_INPUT_H
+#define EXPRESSION_INPUT_H
+
+#include <istream>
+#include <string>
+
+#include "expression_base.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPRESSION_MMAP_SUPPORTED 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define EXPRESSION_MMAP_SUPPORTED 0
+#include <fstream>
+#include <iterator>
+#endif
+
+// Text read by the parser. Characters are addressed by their offsets from the beginning
+// of the input. The text is either a contiguous block of memory that isn't copied (string,
+// memory-mapped file) or it's read from a stream by chunks. In the latter case only the
+// characters starting from the last released offset are kept in memory.
+class ParserInput
+{
+public:
+	// Memory must outlive the input
+	ParserInput(const char *data, size_t size) :
+		m_data(data), m_begin(0), m_end(size), m_released(0), m_in(nullptr), m_chunk_size(0)
+	{
+	}
+	explicit ParserInput(const std::string &s) :
+		ParserInput(s.data(), s.length())
+	{
+	}
+	explicit ParserInput(std::istream &in, size_t chunk_size = 1 << 16) :
+		m_data(nullptr), m_begin(0), m_end(0), m_released(0), m_in(&in),
+		m_chunk_size(chunk_size == 0 ? 1 : chunk_size)
+	{
+	}
+
+	ParserInput(const ParserInput&) = delete;
+	ParserInput& operator=(const ParserInput&) = delete;
+
+	// Whether there is a character at offset id, reads the stream up to it if needed
+	bool has(size_t id)
+	{
+		return (id < m_end) || fill(id);
+	}
+	// has(id) must be true and id must not be released
+	char operator[](size_t id) const
+	{
+		return m_data[id - m_begin];
+	}
+	// Characters in [begin, end), all of them must have been read and not released
+	std::string substr(size_t begin, size_t end) const
+	{
+		return std::string(m_data + (begin - m_begin), end - begin);
+	}
+	// Same, but reuses memory of res
+	void substr(size_t begin, size_t end, std::string &res) const
+	{
+		res.assign(m_data + (begin - m_begin), end - begin);
+	}
+	// Pointer to the character at offset id, the rest of the input is available up to end().
+	// Only for contiguous inputs or after readAll().
+	const char* data(size_t id) const
+	{
+		return m_data + (id - m_begin);
+	}
+	// Offset after the last character that is already in memory
+	size_t end() const
+	{
+		return m_end;
+	}
+
+	// Characters before offset id are no longer needed
+	void release(size_t id)
+	{
+		if(id > m_released) {
+			m_released = id;
+		}
+	}
+	// Reads the whole rest of the stream, nothing is released after that
+	void readAll()
+	{
+		m_released = m_begin;
+		while(fill(m_end)) {
+		}
+		m_in = nullptr;
+	}
+	bool contiguous() const
+	{
+		return m_in == nullptr;
+	}
+
+	// Part of the text around offset id with line breaks replaced by spaces, for error
+	// messages. Returns false if the offset is no longer available, otherwise caret is the
+	// position of id in the result.
+	bool excerpt(size_t id, std::string &res, size_t &caret) const
+	{
+		const size_t radius = 40;
+		if((id < m_begin) || (id > m_end)) {
+			return false;
+		}
+		size_t begin = (id - m_begin > radius) ? id - radius : m_begin;
+		size_t end = (m_end - id > radius) ? id + radius : m_end;
+		res = substr(begin, end);
+		for(auto &c : res) {
+			if((c == '\n') || (c == '\r') || (c == '\t')) {
+				c = ' ';
+			}
+		}
+		caret = id - begin;
+		return true;
+	}
+private:
+	bool fill(size_t id)
+	{
+		if(m_in == nullptr) {
+			return false;
+		}
+		while(id >= m_end) {
+			// Released characters are dropped once they take at least half of the buffer,
+			// so each character is moved a constant number of times on average
+			if((m_released > m_begin) && ((m_released - m_begin) * 2 >= m_buf.size())) {
+				m_buf.erase(0, m_released - m_begin);
+				m_begin = m_released;
+			}
+			size_t old_size = m_buf.size();
+			m_buf.resize(old_size + m_chunk_size);
+			m_in->read(&m_buf[old_size], m_chunk_size);
+			size_t read = static_cast<size_t>(m_in->gcount());
+			m_buf.resize(old_size + read);
+			m_end += read;
+			m_data = m_buf.data();
+			if(read == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const char *m_data;
+	// Offsets of the first and after the last character in memory
+	size_t m_begin, m_end;
+	size_t m_released;
+	// Stream and buffer with characters [m_begin, m_end) for stream inputs
+	std::istream *m_in;
+	size_t m_chunk_size;
+	std::string m_buf;
+};
+
+// Read-only file mapped to memory, e.g. to be parsed through ParserInput(data(), size())
+// without reading it into a string. Where mmap isn't available the file is read.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string &path) :
+		m_data(nullptr), m_size(0)
+	{
+#if EXPRESSION_MMAP_SUPPORTED
+		int fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0) {
+			throw ExpressionParserException("Can't open file: " + path);
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			throw ExpressionParserException("Can't read file: " + path);
+		}
+		m_size = static_cast<size_t>(st.st_size);
+		if(m_size > 0) {
+			void *mem = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(mem == MAP_FAILED) {
+				close(fd);
+				throw ExpressionParserException("Can't map file: " + path);
+			}
+			m_data = static_cast<const char*>(mem);
+		}
+		close(fd);
+#else
+		std::ifstream in(path, std::ios::binary);
+		if(!in) {
+			throw ExpressionParserException("Can't open file: " + path);
+		}
+		m_buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		m_data = m_buf.data();
+		m_size = m_buf.size();
+#endif
+	}
+	~MappedFile()
+	{
+#if EXPRESSION_MMAP_SUPPORTED
+		if(m_data != nullptr) {
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const
+	{
+		return m_data;
+	}
+	size_t size() const
+	{
+		return m_size;
+	}
+private:
+	const char *m_data;
+	size_t m_size;
+#if !EXPRESSION_MMAP_SUPPORTED
+	std::string m_buf;
+#endif
+};
+
+#endif
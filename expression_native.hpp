@@ -0,0 +1,344 @@
+#ifndef EXPRESSION_NATIVE_H
+#define EXPRESSION_NATIVE_H
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "expression_program.hpp"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define EXPRESSION_NATIVE_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define EXPRESSION_NATIVE_SUPPORTED 0
+#endif
+
+// Program translated to x86-64 machine code (System V calling convention). Built-in
+// operations, variables and constants are executed directly, plain functions of fixed
+// arity that never throw (see Function::nothrow) are called directly, other functions are
+// called through a helper. Only programs over int are supported, for other types and on
+// other platforms compile() returns false and the caller should keep using the interpreter.
+template <typename T>
+class NativeProgram
+{
+public:
+	static bool supported()
+	{
+		return EXPRESSION_NATIVE_SUPPORTED && std::is_same<T, int>::value;
+	}
+
+	// Returns false if the program can't be translated, previous code is dropped anyway
+	bool compile(const Program <T> &program)
+	{
+		m_code.reset();
+		if(!supported()) {
+			return false;
+		}
+		m_code = generate(program);
+		return m_code != nullptr;
+	}
+
+	bool compiled() const
+	{
+		return m_code != nullptr;
+	}
+
+	void clear()
+	{
+		m_code.reset();
+	}
+
+	// vars[i] is the value of variable with id i. May be called concurrently.
+	T eval(const T *vars) const
+	{
+		Context ctx;
+		T res = m_code->entry(vars, &ctx);
+		if(ctx.error) {
+			std::rethrow_exception(ctx.error);
+		}
+		return res;
+	}
+protected:
+	typedef typename Program<T>::Instruction Instruction;
+	typedef typename Program<T>::Opcode Opcode;
+
+	// Data of one evaluation passed to the generated code
+	struct Context
+	{
+		Args <T> args;
+		// Exceptions can't propagate through generated code, so they are caught by the
+		// helper and rethrown after the code returns
+		std::exception_ptr error;
+	};
+	typedef T (*Entry)(const T *vars, Context *ctx);
+
+	struct Code
+	{
+		Code() :
+			mem(nullptr), size(0), entry(nullptr)
+		{
+		}
+		~Code()
+		{
+#if EXPRESSION_NATIVE_SUPPORTED
+			if(mem != nullptr) {
+				munmap(mem, size);
+			}
+#endif
+		}
+		void *mem;
+		size_t size;
+		Entry entry;
+		// Copies of instructions calling call(), generated code refers to them
+		std::vector <Instruction> calls;
+	};
+
+	// Whether the generated code calls the function through call() below
+	static bool callsHelper(const Instruction &i)
+	{
+		switch(i.op) {
+		case Opcode::CALL:
+			return true;
+		case Opcode::CALL1:
+		case Opcode::CALL2:
+			return !i.func->nothrow;
+		default:
+			return false;
+		}
+	}
+
+	// Called from the generated code for CALL instructions and for plain functions that
+	// may throw. Arguments are the 64-bit stack slots starting from sp, the last argument
+	// is at sp[0].
+	static T call(const Instruction *ins, const uint64_t *sp, Context *ctx)
+	{
+		try {
+			ctx->args.resize(ins->arg);
+			for(size_t k = 0; k < ins->arg; ++k) {
+				ctx->args[k] = static_cast<T>(static_cast<int32_t>(sp[ins->arg - 1 - k]));
+			}
+			return ins->func->func(ctx->args);
+		} catch(...) {
+			if(!ctx->error) {
+				ctx->error = std::current_exception();
+			}
+			return T();
+		}
+	}
+
+	class Assembler
+	{
+	public:
+		void byte(uint8_t b)
+		{
+			m_buf.push_back(b);
+		}
+		void bytes(std::initializer_list <uint8_t> b)
+		{
+			m_buf.insert(m_buf.end(), b);
+		}
+		void imm32(int32_t v)
+		{
+			for(int i = 0; i < 4; ++i) {
+				byte(static_cast<uint8_t>(static_cast<uint32_t>(v) >> (8 * i)));
+			}
+		}
+		void imm64(uint64_t v)
+		{
+			for(int i = 0; i < 8; ++i) {
+				byte(static_cast<uint8_t>(v >> (8 * i)));
+			}
+		}
+		const std::vector <uint8_t>& buffer() const
+		{
+			return m_buf;
+		}
+	private:
+		std::vector <uint8_t> m_buf;
+	};
+
+	static std::shared_ptr <const Code> generate(const Program <T> &program)
+	{
+#if EXPRESSION_NATIVE_SUPPORTED
+		std::shared_ptr <Code> code(new Code());
+		Assembler a;
+		// Temporary slots are kept below saved registers, frame size is kept a multiple
+		// of 16 so that the stack is aligned when it's empty
+		size_t temps = (program.temps() + 1) / 2 * 2;
+		auto temp = [](size_t slot) {
+			return static_cast<int32_t>(-24 - 8 * static_cast<int64_t>(slot));
+		};
+		a.byte(0x55);                          // push rbp
+		a.bytes({0x48, 0x89, 0xE5});           // mov rbp, rsp
+		a.byte(0x53);                          // push rbx
+		a.bytes({0x41, 0x54});                 // push r12
+		a.bytes({0x48, 0x81, 0xEC});           // sub rsp, imm32
+		a.imm32(static_cast<int32_t>(8 * temps));
+		a.bytes({0x48, 0x89, 0xFB});           // mov rbx, rdi
+		a.bytes({0x49, 0x89, 0xF4});           // mov r12, rsi
+
+		size_t calls = 0;
+		for(const auto &i : program.code()) {
+			calls += callsHelper(i);
+		}
+		// Generated code keeps pointers to elements, so the vector must never reallocate
+		code->calls.reserve(calls);
+
+		// Each value on the stack occupies 8 bytes, only the low 4 bytes are used
+		size_t depth = 0;
+		for(const auto &i : program.code()) {
+			if(callsHelper(i)) {
+				code->calls.push_back(i);
+				// Stack has to be aligned to 16 bytes at the call
+				uint8_t pad = (depth % 2) ? 8 : 0;
+				if(pad) {
+					a.bytes({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+				}
+				a.bytes({0x48, 0xBF});         // mov rdi, imm64
+				a.imm64(reinterpret_cast<uint64_t>(&code->calls.back()));
+				a.bytes({0x48, 0x8D, 0x74, 0x24, pad}); // lea rsi, [rsp + pad]
+				a.bytes({0x4C, 0x89, 0xE2});   // mov rdx, r12
+				a.bytes({0x48, 0xB8});         // mov rax, imm64
+				a.imm64(reinterpret_cast<uint64_t>(&NativeProgram::call));
+				a.bytes({0xFF, 0xD0});         // call rax
+				a.bytes({0x48, 0x81, 0xC4});   // add rsp, imm32
+				a.imm32(static_cast<int32_t>(pad + 8 * i.arg));
+				a.byte(0x50);                  // push rax
+				depth -= i.arg - 1;
+				continue;
+			}
+			switch(i.op) {
+			case Opcode::CONSTANT:
+				a.byte(0x68);                  // push imm32
+				a.imm32(static_cast<int32_t>(i.val));
+				++depth;
+				break;
+			case Opcode::VARIABLE:
+				a.bytes({0x8B, 0x83});         // mov eax, [rbx + disp32]
+				a.imm32(static_cast<int32_t>(4 * i.arg));
+				a.byte(0x50);                  // push rax
+				++depth;
+				break;
+			case Opcode::LOAD:
+				a.bytes({0x8B, 0x85});         // mov eax, [rbp + disp32]
+				a.imm32(temp(i.arg));
+				a.byte(0x50);                  // push rax
+				++depth;
+				break;
+			case Opcode::STORE:
+				a.bytes({0x8B, 0x04, 0x24});   // mov eax, [rsp]
+				a.bytes({0x89, 0x85});         // mov [rbp + disp32], eax
+				a.imm32(temp(i.arg));
+				break;
+			case Opcode::ADD:
+				a.byte(0x59);                  // pop rcx
+				a.bytes({0x01, 0x0C, 0x24});   // add [rsp], ecx
+				--depth;
+				break;
+			case Opcode::SUB:
+				a.byte(0x59);                  // pop rcx
+				a.bytes({0x29, 0x0C, 0x24});   // sub [rsp], ecx
+				--depth;
+				break;
+			case Opcode::MUL:
+				a.bytes({0x59, 0x58});         // pop rcx; pop rax
+				a.bytes({0x0F, 0xAF, 0xC1});   // imul eax, ecx
+				a.byte(0x50);                  // push rax
+				--depth;
+				break;
+			case Opcode::DIV:
+				a.bytes({0x59, 0x58});         // pop rcx; pop rax
+				a.byte(0x99);                  // cdq
+				a.bytes({0xF7, 0xF9});         // idiv ecx
+				a.byte(0x50);                  // push rax
+				--depth;
+				break;
+			case Opcode::NEG:
+				a.bytes({0xF7, 0x1C, 0x24});   // neg dword [rsp]
+				break;
+			case Opcode::ABS:
+				a.byte(0x58);                  // pop rax
+				a.bytes({0x89, 0xC1});         // mov ecx, eax
+				a.bytes({0xF7, 0xD8});         // neg eax
+				a.bytes({0x0F, 0x48, 0xC1});   // cmovs eax, ecx
+				a.byte(0x50);                  // push rax
+				break;
+			case Opcode::MIN:
+			case Opcode::MAX:
+				a.bytes({0x59, 0x58});         // pop rcx; pop rax
+				a.bytes({0x39, 0xC8});         // cmp eax, ecx
+				if(i.op == Opcode::MIN) {
+					a.bytes({0x0F, 0x4F, 0xC1}); // cmovg eax, ecx
+				} else {
+					a.bytes({0x0F, 0x4C, 0xC1}); // cmovl eax, ecx
+				}
+				a.byte(0x50);                  // push rax
+				--depth;
+				break;
+			case Opcode::CALL:
+				// Handled above
+				break;
+			case Opcode::CALL1:
+			case Opcode::CALL2:
+			{
+				// Arguments are passed in edi and esi
+				if(i.op == Opcode::CALL2) {
+					a.byte(0x5E);              // pop rsi
+				}
+				a.byte(0x5F);                  // pop rdi
+				depth -= i.arg;
+				uint8_t pad = (depth % 2) ? 8 : 0;
+				if(pad) {
+					a.bytes({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+				}
+				a.bytes({0x48, 0xB8});         // mov rax, imm64
+				if(i.op == Opcode::CALL1) {
+					a.imm64(reinterpret_cast<uint64_t>(i.func->unary));
+				} else {
+					a.imm64(reinterpret_cast<uint64_t>(i.func->binary));
+				}
+				a.bytes({0xFF, 0xD0});         // call rax
+				if(pad) {
+					a.bytes({0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+				}
+				a.byte(0x50);                  // push rax
+				++depth;
+				break;
+			}
+			}
+		}
+		a.byte(0x58);                          // pop rax
+		a.bytes({0x48, 0x8D, 0x65, 0xF0});     // lea rsp, [rbp - 16]
+		a.bytes({0x41, 0x5C});                 // pop r12
+		a.byte(0x5B);                          // pop rbx
+		a.byte(0x5D);                          // pop rbp
+		a.byte(0xC3);                          // ret
+
+		code->size = a.buffer().size();
+		void *mem = mmap(nullptr, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED) {
+			return nullptr;
+		}
+		code->mem = mem;
+		std::memcpy(mem, a.buffer().data(), code->size);
+		if(mprotect(mem, code->size, PROT_READ | PROT_EXEC) != 0) {
+			return nullptr;
+		}
+		code->entry = reinterpret_cast<Entry>(mem);
+		return code;
+#else
+		(void)program;
+		return nullptr;
+#endif
+	}
+
+	// Generated code is immutable, so copies of the program share it
+	std::shared_ptr <const Code> m_code;
+};
+
+#endif
@@ -2,13 +2,17 @@
 #define EXPRESSION_PARSER_H
 
 #include <map>
+#include <cctype>
 #include <exception>
 #include <regex>
 #include <stack>
 #include <sstream>
+#include <type_traits>
 
 #include "expression_base.hpp"
 #include "expression_cell.hpp"
+#include "expression_arena.hpp"
+#include "expression_input.hpp"
 
 template <typename T>
 class ExpressionParser
@@ -25,10 +29,60 @@ public:
 		size_t begin_id, cur_id;
 	};
 
-	ExpressionParser(ExpressionParserSettings <T> &s, const std::string &_str);
+	// Working memory of the parser. One object may be given to parsers that run one after
+	// another (e.g. for the lines of a file), so that its buffers are allocated only once.
+	struct Scratch
+	{
+		// Drops the contents and keeps allocated memory where possible
+		void clear()
+		{
+			while(!parents.empty()) {
+				parents.pop();
+			}
+			while(!cells.empty()) {
+				cells.pop();
+			}
+			while(!lexems.empty()) {
+				lexems.pop();
+			}
+			variable_ids.clear();
+		}
+
+		// Each function and parenthesis pushes it's own object vector to the stack. This is mainly used for resolvig operators ordering.
+		std::stack <std::vector <Cell <T>*>, std::vector <std::vector <Cell <T>*> > > parents;
+		// Top of this stack is always equals current cell of the current environment. Each function and parenthesis
+		// creates it's own environment.
+		std::stack <Cell <T>*, std::vector <Cell <T>*> > cells;
+		// Each function and parenthesis pushes it's own object of class Lexeme. This is mainly used for displaying errors.
+		std::stack <Lexeme, std::vector <Lexeme> > lexems;
+		// Position of each name in variables
+		std::map <std::string, size_t> variable_ids;
+		// Name of the current variable
+		std::string name;
+	};
+
+	// Created cells are owned by arena
+	ExpressionParser(const ExpressionParserSettings <T> &s, const std::string &_str,
+	                 std::vector <std::string> &_variables, CellArena <T> &_arena);
+	// Reads input directly, e.g. from a stream or a memory-mapped file. Streams are
+	// consumed by chunks, only the part starting from the current token is kept in memory.
+	// Regex mode needs the whole text in memory, so streams are read completely in that mode.
+	// If scratch is given, it's used instead of the parser's own memory.
+	ExpressionParser(const ExpressionParserSettings <T> &s, ParserInput &_input,
+	                 std::vector <std::string> &_variables, CellArena <T> &_arena,
+	                 Scratch *_scratch = nullptr);
+	// Throws ExpressionParserException if the string is malformed
 	Cell <T>* parse();
+	// Same as parse(), but returns nullptr on error without throwing, see error()
+	Cell <T>* tryParse();
+	// Error of the last call of tryParse()
+	const ExpressionParserError& error() const
+	{
+		return parse_error;
+	}
 protected:
 	void parseNextToken();
+	void parseNextTokenRegex();
 	void parseConstant(size_t end_id);
 	void parseParenthesisBegin(size_t end_id);
 	void parseParenthesisEnd(size_t end_id);
@@ -38,62 +92,122 @@ protected:
 	void parseFunctionArg(size_t id);
 	void parseFunctionEnd(size_t id);
 
-	void throwError(const std::string &msg, size_t id) const;
+	// Operand of prefix operators is complete, so they no longer take part in matching brackets
+	void popPrefixOperators();
+
+	// Records the error, parsing stops after the current token
+	void fail(ExpressionParserError::Code code, size_t id);
+	void throwError() const;
 
 	typename Functions<T>::const_iterator findItem(size_t id, const Functions <T> &coll,
-	                                               typename Function<T>::Type type = Function<T>::Type::NONE);
+	                                               const FunctionIndex <T> &index,
+	                                               typename Function<T>::Type type = Function<T>::Type::NONE) const;
 
-	bool isOperator(size_t id);
+	bool isOperator(size_t id) const;
 
 
 	// Returns length of match (zero in case there is no match)
 	size_t matchRegex(const std::regex &e);
 
-	ExpressionParserSettings <T> &settings;
+	// Built-in lexer helpers, each returns index of the first character after the match
+	size_t skipWhitespace(size_t id) const;
+	size_t matchDigits(size_t id) const;
+	// Digits, for floating point types also optional fractional part and exponent
+	size_t matchNumber(size_t id) const;
+	size_t matchIdentifier(size_t id) const;
 
-	bool is_prev_num;
-	// Each function and parenthesis pushes it's own object vector to the stack. This is mainly used for resolvig operators ordering.
-	std::stack <std::vector <Cell <T>*> > parents;
-	// Top of this stack is always equals current cell of the current environment. Each function and parenthesis
-	// creates it's own environment.
-	std::stack <Cell <T>*> cells;
-
-	// Each function and parenthesis pushes it's own object of class Lexeme. This is mainly used for displaying errors.
-	std::stack <Lexeme> lexems;
+	const ExpressionParserSettings <T> &settings;
+	// Names of variables in order of their first occurrence
+	std::vector <std::string> &variables;
+	CellArena <T> &arena;
 
-	// For displaying errors
-	const std::string &str;
+	bool is_prev_num;
+	// Used when no scratch is given to the constructor
+	Scratch own_scratch;
+	Scratch &scratch;
+	// Parts of scratch, see Scratch
+	decltype(Scratch::parents) &parents;
+	decltype(Scratch::cells) &cells;
+	decltype(Scratch::lexems) &lexems;
+	decltype(Scratch::variable_ids) &variable_ids;
+
+	// Used when the parser is given a string
+	ParserInput string_input;
+	ParserInput &input;
+	ExpressionParserError parse_error;
 };
 
 template <typename T>
-ExpressionParser<T>::ExpressionParser(ExpressionParserSettings <T> &_settings,
-                                      const std::string &_str) :
-	settings(_settings), str(_str)
+ExpressionParser<T>::ExpressionParser(const ExpressionParserSettings <T> &_settings,
+                                      const std::string &_str, std::vector <std::string> &_variables,
+                                      CellArena <T> &_arena) :
+	settings(_settings), variables(_variables), arena(_arena), scratch(own_scratch),
+	parents(scratch.parents), cells(scratch.cells), lexems(scratch.lexems), variable_ids(scratch.variable_ids),
+	string_input(_str), input(string_input)
 {
+	for(size_t i = 0; i < variables.size(); ++i) {
+		variable_ids[variables[i]] = i;
+	}
+}
+
+template <typename T>
+ExpressionParser<T>::ExpressionParser(const ExpressionParserSettings <T> &_settings,
+                                      ParserInput &_input, std::vector <std::string> &_variables,
+                                      CellArena <T> &_arena, Scratch *_scratch) :
+	settings(_settings), variables(_variables), arena(_arena), scratch(_scratch ? *_scratch : own_scratch),
+	parents(scratch.parents), cells(scratch.cells), lexems(scratch.lexems), variable_ids(scratch.variable_ids),
+	string_input(nullptr, 0), input(_input)
+{
+	scratch.clear();
+	for(size_t i = 0; i < variables.size(); ++i) {
+		variable_ids[variables[i]] = i;
+	}
 }
 
 template <typename T>
 Cell <T>* ExpressionParser<T>::parse()
 {
-	if(str.length() == 0) {
+	Cell <T> *res = tryParse();
+	if(parse_error) {
+		throwError();
+	}
+	return res;
+}
+
+template <typename T>
+Cell <T>* ExpressionParser<T>::tryParse()
+{
+	parse_error = ExpressionParserError();
+	if(settings.use_regex) {
+		input.readAll();
+	}
+	if(!input.has(0)) {
 		return nullptr;
 	}
 	size_t id = 0;
 	lexems.push(Lexeme(LexemeType::UNKNOWN, id, id));
 	parents.push(std::vector <Cell <T>*>());
-	cells.push(new Cell <T>());
+	cells.push(arena.create());
 	is_prev_num = false;
-	while(lexems.top().cur_id < str.length()) {
+	while(input.has(lexems.top().cur_id)) {
+		// Tokens never look at characters before their beginning
+		input.release(lexems.top().cur_id);
 		parseNextToken();
+		if(parse_error) {
+			return nullptr;
+		}
 	}
 	if(lexems.top().type == LexemeType::PARENTHESIS) {
-		throwError("Mismatched parentheses: ", lexems.top().begin_id);
+		fail(ExpressionParserError::Code::MISMATCHED_PARENTHESES, lexems.top().begin_id);
+		return nullptr;
 	}
 	if(lexems.top().type == LexemeType::FUNCTION) {
-		throwError("Unfinished function call: ", lexems.top().begin_id);
+		fail(ExpressionParserError::Code::UNFINISHED_FUNCTION_CALL, lexems.top().begin_id);
+		return nullptr;
 	}
 	if(cells.top()->type == Cell<T>::Type::NONE) {
-		throwError("Expected right argument for operator: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::EXPECTED_RIGHT_ARGUMENT, lexems.top().cur_id);
+		return nullptr;
 	}
 	Cell <T> *res = nullptr;
 	if(parents.top().empty()) {
@@ -101,12 +215,51 @@ Cell <T>* ExpressionParser<T>::parse()
 	} else {
 		res = parents.top()[0];
 	}
-	// res->sort();
+	res->updateHash();
 	return res;
 }
 
 template <typename T>
 void ExpressionParser<T>::parseNextToken()
+{
+	if(settings.use_regex) {
+		parseNextTokenRegex();
+		return;
+	}
+	// Token class is determined by the current character, so every character
+	// of the input is looked at a constant number of times.
+	size_t id = lexems.top().cur_id;
+	unsigned char c = input[id];
+	if(isspace(c)) {
+		lexems.top().cur_id = skipWhitespace(id);
+	} else if(isdigit(c)) {
+		parseConstant(matchNumber(id));
+	} else if(c == '(') {
+		parseParenthesisBegin(id + 1);
+	} else if((c == ')') && (lexems.top().type == LexemeType::PARENTHESIS)) {
+		parseParenthesisEnd(id + 1);
+	} else if(isOperator(id)) {
+		parseOperatorBegin();
+	} else if(isalpha(c)) {
+		size_t end_id = matchIdentifier(id);
+		size_t next_id = skipWhitespace(end_id);
+		if(input.has(next_id) && (input[next_id] == '(')) {
+			parseFunctionBegin(id, next_id + 1);
+		} else {
+			parseVariable(end_id);
+		}
+	} else if((c == ')') && (lexems.top().type == LexemeType::FUNCTION)) {
+		parseFunctionEnd(id + 1);
+	} else if((c == ',') && (lexems.top().type == LexemeType::FUNCTION)) {
+		parseFunctionArg(id + 1);
+	} else {
+		fail(ExpressionParserError::Code::UNRECOGNISED_TOKEN, id);
+		return;
+	}
+}
+
+template <typename T>
+void ExpressionParser<T>::parseNextTokenRegex()
 {
 	size_t len = 0;
 	if((len = matchRegex(settings.regex_whitespace))) {
@@ -131,7 +284,8 @@ void ExpressionParser<T>::parseNextToken()
 	} else if((len = matchRegex(settings.regex_variable))) {
 		parseVariable(lexems.top().cur_id + len);
 	} else {
-		throwError("Unrecognised token: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::UNRECOGNISED_TOKEN, lexems.top().cur_id);
+		return;
 	}
 }
 
@@ -139,44 +293,42 @@ template <typename T>
 void ExpressionParser<T>::parseVariable(size_t end_id)
 {
 	if(is_prev_num) {
-		throwError("Expected operator between two values: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::EXPECTED_OPERATOR_BETWEEN_VALUES, lexems.top().cur_id);
+		return;
 	}
-	int start = lexems.top().cur_id;
-	std::string varname = str.substr(start, end_id - start);
+	size_t start = lexems.top().cur_id;
+	std::string &varname = scratch.name;
+	input.substr(start, end_id, varname);
 	cells.top()->type = Cell<T>::Type::VARIABLE;
 	cells.top()->var.name = varname;
 	is_prev_num = true;
 
+	popPrefixOperators();
 	lexems.top().cur_id = end_id;
 
-	bool exist = false;
-	for(const auto &i : settings.variables) {
-		if(i == varname) {
-			exist = true;
-			break;
-		}
-	}
-	if(!exist) {
-		settings.variables.push_back(varname);
+	auto it = variable_ids.find(varname);
+	if(it == variable_ids.end()) {
+		it = variable_ids.insert(std::make_pair(varname, variables.size())).first;
+		variables.push_back(varname);
 	}
+	cells.top()->var.id = it->second;
 }
 
 template <typename T>
 void ExpressionParser<T>::parseConstant(size_t end_id)
 {
 	if(is_prev_num) {
-		throwError("Expected operator between two values: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::EXPECTED_OPERATOR_BETWEEN_VALUES, lexems.top().cur_id);
+		return;
 	}
-	int start = lexems.top().cur_id;
-	std::stringstream ss(str.substr(start, end_id - start));
+	size_t start = lexems.top().cur_id;
+	std::stringstream ss(input.substr(start, end_id));
 	T val;
 	ss >> val;
 	cells.top()->type = Cell<T>::Type::CONSTANT;
 	cells.top()->val = val;
 	is_prev_num = true;
-	if(lexems.top().type == LexemeType::OPERATOR) {
-		lexems.pop();
-	}
+	popPrefixOperators();
 	lexems.top().cur_id = end_id;
 }
 
@@ -184,7 +336,8 @@ template <typename T>
 void ExpressionParser<T>::parseParenthesisBegin(size_t end_id)
 {
 	if(is_prev_num) {
-		throwError("Expected operator between two values: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::EXPECTED_OPERATOR_BETWEEN_VALUES, lexems.top().cur_id);
+		return;
 	}
 	Cell <T> *cell = cells.top();
 	cells.push(cell);
@@ -195,6 +348,10 @@ void ExpressionParser<T>::parseParenthesisBegin(size_t end_id)
 template <typename T>
 void ExpressionParser<T>::parseParenthesisEnd(size_t end_id)
 {
+	if(cells.top()->type == Cell <T>::Type::NONE) {
+		fail(ExpressionParserError::Code::UNFINISHED_EXPRESSION, lexems.top().cur_id);
+		return;
+	}
 	Cell <T> *cell = nullptr;
 	if(parents.top().empty()) {
 		cell = cells.top();
@@ -210,9 +367,7 @@ void ExpressionParser<T>::parseParenthesisEnd(size_t end_id)
 	cells.top() = cell;
 
 	lexems.pop();
-	if(lexems.top().type == LexemeType::OPERATOR) {
-		lexems.pop();
-	}
+	popPrefixOperators();
 	lexems.top().cur_id = end_id;
 	is_prev_num = true;
 }
@@ -222,34 +377,36 @@ void ExpressionParser<T>::parseOperatorBegin()
 {
 	typename Functions<T>::const_iterator f;
 	size_t id = lexems.top().cur_id;
-	Cell <T> *op_cell = new Cell <T>();
+	Cell <T> *op_cell = arena.create();
 	op_cell->type = Cell <T>::Type::FUNCTION;
 	if(!is_prev_num) {
 		// We have to parse it as prefix operator because previous token is some operator.
-		f = findItem(id, settings.operators, Function<T>::Type::PREFIX);
+		f = findItem(id, settings.operators, settings.operators_index, Function<T>::Type::PREFIX);
 		if(f != settings.operators.end()) {
 			Cell <T> *arg_cell = cells.top();
 			op_cell->func.args.push_back(arg_cell);
 			lexems.push(Lexeme(LexemeType::OPERATOR, id, id + f->name.length()));
 		} else {
-			throwError("Expected prefix operator: ", id);
+			fail(ExpressionParserError::Code::EXPECTED_PREFIX_OPERATOR, id);
+			return;
 		}
 	} else {
 		// We have to parse it as infix/postfix operator because previous token is some value.
 		// First argument for these operators is already stored for us in cells.top(), so we don't have to do anything.
-		if((f = findItem(id, settings.operators, Function<T>::Type::INFIX)) != settings.operators.end()) {
+		if((f = findItem(id, settings.operators, settings.operators_index, Function<T>::Type::INFIX)) != settings.operators.end()) {
 			Cell <T> *arg1_cell = cells.top();
-			Cell <T> *arg2_cell = new Cell <T>();
+			Cell <T> *arg2_cell = arena.create();
 			op_cell->func.args.push_back(arg1_cell);
 			op_cell->func.args.push_back(arg2_cell);
 			cells.top() = arg2_cell;
 			is_prev_num = false;
-		} else if((f = findItem(id, settings.operators, Function<T>::Type::POSTFIX)) != settings.operators.end()) {
+		} else if((f = findItem(id, settings.operators, settings.operators_index, Function<T>::Type::POSTFIX)) != settings.operators.end()) {
 			Cell <T> *arg_cell = cells.top();
 			op_cell->func.args.push_back(arg_cell);
 			is_prev_num = true;
 		} else {
-			throwError("Expected postifx or prefix operator ", id);
+			fail(ExpressionParserError::Code::EXPECTED_INFIX_OR_POSTFIX_OPERATOR, id);
+			return;
 		}
 		// Move id forward
 		lexems.top().cur_id += f->name.length();
@@ -258,7 +415,10 @@ void ExpressionParser<T>::parseOperatorBegin()
 	if(!parents.top().empty()) {
 		int id = parents.top().size() - 1;
 		Cell <T> *last_par = nullptr;
-		while((id >= 0) && (f->precedence < parents.top()[id]->func.iter->precedence)) {
+		// Infix operators are left-associative, so they also close operators of equal precedence
+		bool infix = (f->type == Function<T>::Type::INFIX);
+		while((id >= 0) && ((f->precedence < parents.top()[id]->func.iter->precedence)
+		                    || (infix && (f->precedence == parents.top()[id]->func.iter->precedence)))) {
 			last_par = parents.top()[id];
 			parents.top().pop_back();
 			--id;
@@ -287,14 +447,16 @@ template <typename T>
 void ExpressionParser<T>::parseFunctionBegin(size_t id, size_t end_id)
 {
 	if(is_prev_num) {
-		throwError("Expected operator: ", id);
+		fail(ExpressionParserError::Code::EXPECTED_OPERATOR, id);
+		return;
 	}
-	auto f = findItem(id, settings.functions);
+	auto f = findItem(id, settings.functions, settings.functions_index);
 	if(f == settings.functions.end()) {
-		throwError("Undefined function: ", id);
+		fail(ExpressionParserError::Code::UNDEFINED_FUNCTION, id);
+		return;
 	}
 	Cell <T> *cell = cells.top();
-	Cell <T> *arg_cell = new Cell <T>();
+	Cell <T> *arg_cell = arena.create();
 	cell->type = Cell <T>::Type::FUNCTION;
 	cell->func.args.push_back(arg_cell);
 	cell->func.iter = f;
@@ -309,13 +471,17 @@ template <typename T>
 void ExpressionParser<T>::parseFunctionArg(size_t id)
 {
 	if(cells.top()->type == Cell <T>::Type::NONE) {
-		throwError("Unfinished expression: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::UNFINISHED_EXPRESSION, lexems.top().cur_id);
+		return;
 	}
 	if(parents.top()[0]->func.iter->args_num == parents.top()[0]->func.args.size()) {
-		throwError("Excess argument: ", id);
+		fail(ExpressionParserError::Code::EXCESS_ARGUMENT, id);
+		return;
 	}
-	Cell <T> *arg_cell = new Cell <T>();
+	Cell <T> *arg_cell = arena.create();
 	parents.top()[0]->func.args.push_back(arg_cell);
+	// Operators of the previous argument are finished, only the function itself is left
+	parents.top().resize(1);
 	cells.top() = arg_cell;
 	lexems.top().cur_id = id;
 	is_prev_num = false;
@@ -325,64 +491,134 @@ template <typename T>
 void ExpressionParser<T>::parseFunctionEnd(size_t id)
 {
 	if(cells.top()->type == Cell <T>::Type::NONE) {
-		throwError("Unfinished expression: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::UNFINISHED_EXPRESSION, lexems.top().cur_id);
+		return;
 	}
 	if(parents.top()[0]->func.iter->args_num > parents.top()[0]->func.args.size()) {
-		throwError("Not enough arguments: ", lexems.top().cur_id);
+		fail(ExpressionParserError::Code::NOT_ENOUGH_ARGUMENTS, lexems.top().cur_id);
+		return;
 	}
 	// Set current cell to the funciton cell
 	cells.pop();
 	cells.top() = parents.top()[0];
 	parents.pop();
 	lexems.pop();
+	popPrefixOperators();
 	lexems.top().cur_id = id;
 }
 
 template <typename T>
-void ExpressionParser<T>::throwError(const std::string &msg, size_t id) const
+void ExpressionParser<T>::popPrefixOperators()
+{
+	while(lexems.top().type == LexemeType::OPERATOR) {
+		lexems.pop();
+	}
+}
+
+template <typename T>
+void ExpressionParser<T>::fail(ExpressionParserError::Code code, size_t id)
+{
+	parse_error.code = code;
+	parse_error.offset = id;
+}
+
+template <typename T>
+void ExpressionParser<T>::throwError() const
 {
 	std::stringstream ss;
-	ss << msg << endl;
-	ss << str << endl;
-	int n = id;
-	for(int i = 0; i < n; ++i) {
-		ss << " ";
-	}
-	ss << "^" << endl;
-	throw ExpressionParserException(ss.str());
+	ss << parse_error.message() << ": " << endl;
+	std::string text;
+	size_t caret = 0;
+	if(input.excerpt(parse_error.offset, text, caret)) {
+		ss << text << endl;
+		ss << std::string(caret, ' ') << "^" << endl;
+	} else {
+		ss << "at offset " << parse_error.offset << endl;
+	}
+	throw ExpressionParserException(ss.str(), parse_error);
 }
 
 template <typename T>
 typename Functions<T>::const_iterator ExpressionParser<T>::findItem(size_t id, const Functions<T> &coll,
-                                                        typename Function<T>::Type type)
+                                                        const FunctionIndex <T> &index,
+                                                        typename Function<T>::Type type) const
 {
-	auto res = coll.end();
-	for(auto i = coll.begin(); i != coll.end(); ++i) {
-		if((str.length() - id >= i->name.length())
-		   && (str.substr(id, i->name.length()) == i->name)
-		   && ((res == coll.end()) || (res->name.length() < i->name.length()))
-		   && ((type == Function<T>::Type::NONE) || (type == i->type))) {
-			res = i;
-		}
-	}
-	return res;
+	size_t pos = index.longestMatch(input, id, type);
+	return (pos == FunctionIndex<T>::npos) ? coll.end() : coll.begin() + pos;
 }
 
 template <typename T>
-bool ExpressionParser<T>::isOperator(size_t id)
+bool ExpressionParser<T>::isOperator(size_t id) const
 {
-	return findItem(id, settings.operators) != settings.operators.end();
+	return settings.operators_index.longestMatch(input, id) != FunctionIndex<T>::npos;
 }
 
 template <typename T>
 size_t ExpressionParser<T>::matchRegex(const std::regex &e)
 {
-	std::smatch sm;
-	if(regex_search(str.begin() + lexems.top().cur_id, str.end(), sm, e) && (sm.position() == 0)) {
+	std::cmatch sm;
+	// match_continuous anchors the search at the current position, otherwise
+	// regex_search would scan the whole rest of the string for every token.
+	const char *begin = input.data(lexems.top().cur_id);
+	if(regex_search(begin, input.data(input.end()), sm, e,
+	                std::regex_constants::match_continuous)) {
 		return sm.length();
 	} else {
 		return 0;
 	}
 }
 
+template <typename T>
+size_t ExpressionParser<T>::skipWhitespace(size_t id) const
+{
+	while(input.has(id) && isspace(static_cast<unsigned char>(input[id]))) {
+		++id;
+	}
+	return id;
+}
+
+template <typename T>
+size_t ExpressionParser<T>::matchDigits(size_t id) const
+{
+	while(input.has(id) && isdigit(static_cast<unsigned char>(input[id]))) {
+		++id;
+	}
+	return id;
+}
+
+template <typename T>
+size_t ExpressionParser<T>::matchNumber(size_t id) const
+{
+	id = matchDigits(id);
+	if(!std::is_floating_point<T>::value) {
+		return id;
+	}
+	if(input.has(id) && (input[id] == '.')) {
+		id = matchDigits(id + 1);
+	}
+	if(input.has(id) && ((input[id] == 'e') || (input[id] == 'E'))) {
+		size_t exp = id + 1;
+		if(input.has(exp) && ((input[exp] == '+') || (input[exp] == '-'))) {
+			++exp;
+		}
+		// Otherwise "e" isn't a part of the number
+		if(input.has(exp) && isdigit(static_cast<unsigned char>(input[exp]))) {
+			id = matchDigits(exp);
+		}
+	}
+	return id;
+}
+
+template <typename T>
+size_t ExpressionParser<T>::matchIdentifier(size_t id) const
+{
+	if(input.has(id) && isalpha(static_cast<unsigned char>(input[id]))) {
+		++id;
+		while(input.has(id) && isalnum(static_cast<unsigned char>(input[id]))) {
+			++id;
+		}
+	}
+	return id;
+}
+
 #endif
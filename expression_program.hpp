@@ -0,0 +1,376 @@
+#ifndef EXPRESSION_PROGRAM_H
+#define EXPRESSION_PROGRAM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "expression_base.hpp"
+#include "expression_flat.hpp"
+
+// Tree compiled to a flat list of instructions for a stack machine. Instructions are
+// stored in postorder, so evaluation is a single loop over them without recursion and
+// without allocations.
+template <typename T>
+class Program
+{
+public:
+	// LOAD pushes value of a temporary slot, STORE copies top of the stack to a slot.
+	// CALL1 and CALL2 call plain functions of one and two arguments (Function::unary and
+	// Function::binary), CALL goes through std::function.
+	enum class Opcode {CONSTANT, VARIABLE, LOAD, STORE, CALL, CALL1, CALL2, ADD, SUB, MUL, DIV, NEG, ABS, MIN, MAX};
+	struct Instruction
+	{
+		Opcode op;
+		// Variable id for VARIABLE, number of arguments for CALL*, slot for LOAD and STORE
+		size_t arg;
+		T val;
+		const Function <T> *func;
+	};
+
+	// Number of rows processed by each instruction at once in batch mode
+	static const size_t block_size = 256;
+
+	// Scratch buffers used during evaluation. Const evaluation methods may be called
+	// concurrently as long as each thread uses its own state.
+	struct State
+	{
+		std::vector <T> stack;
+		// Arguments buffer for CALL instructions
+		Args <T> args;
+		// Evaluation stack for batch mode, each element occupies block_size values
+		std::vector <T> block_stack;
+		// Values of shared cells, in batch mode each one occupies block_size values
+		std::vector <T> temps;
+	};
+
+	Program() :
+		m_max_depth(0),
+		m_temps(0)
+	{
+	}
+
+	void compile(const FlatTree <T> &tree);
+	// vars[i] is the value of variable with id i
+	T eval(const T *vars)
+	{
+		return eval(vars, m_state);
+	}
+	T eval(const T *vars, State &state) const;
+	// Evaluates n rows, columns[i][j] is the value of variable with id i in row j.
+	// Each instruction is applied to a block of rows at once, so loops of built-in
+	// operations are vectorized by the compiler.
+	void evalBatch(const T *const *columns, size_t n, T *out)
+	{
+		evalBatch(columns, 0, n, out, m_state);
+	}
+	// Evaluates only rows from [begin, end)
+	void evalBatch(const T *const *columns, size_t begin, size_t end, T *out, State &state) const;
+
+	const std::vector <Instruction>& code() const
+	{
+		return m_code;
+	}
+	// Maximal number of values on the stack during evaluation
+	size_t maxDepth() const
+	{
+		return m_max_depth;
+	}
+	// Number of temporary slots used by LOAD and STORE
+	size_t temps() const
+	{
+		return m_temps;
+	}
+protected:
+	static Opcode opcode(const Function <T> &f);
+	static Instruction instruction(Opcode op, size_t arg)
+	{
+		Instruction res;
+		res.op = op;
+		res.arg = arg;
+		res.val = T();
+		res.func = nullptr;
+		return res;
+	}
+
+	// x[j] = op(x[j], y[j]) / x[j] = op(x[j]) for j < len
+	template <typename Op>
+	static void kernel(T *__restrict x, const T *__restrict y, size_t len, Op op)
+	{
+		for(size_t j = 0; j < len; ++j) {
+			x[j] = op(x[j], y[j]);
+		}
+	}
+	template <typename Op>
+	static void kernel(T *__restrict x, size_t len, Op op)
+	{
+		for(size_t j = 0; j < len; ++j) {
+			x[j] = op(x[j]);
+		}
+	}
+
+	std::vector <Instruction> m_code;
+	size_t m_max_depth;
+	// Number of temporary slots
+	size_t m_temps;
+	// State used by non-const evaluation methods
+	State m_state;
+};
+
+template <typename T>
+typename Program<T>::Opcode Program<T>::opcode(const Function <T> &f)
+{
+	switch(f.builtin) {
+	case Function<T>::Builtin::ADD:
+		return Opcode::ADD;
+	case Function<T>::Builtin::SUB:
+		return Opcode::SUB;
+	case Function<T>::Builtin::MUL:
+		return Opcode::MUL;
+	case Function<T>::Builtin::DIV:
+		return Opcode::DIV;
+	case Function<T>::Builtin::NEG:
+		return Opcode::NEG;
+	case Function<T>::Builtin::ABS:
+		return Opcode::ABS;
+	case Function<T>::Builtin::MIN:
+		return Opcode::MIN;
+	case Function<T>::Builtin::MAX:
+		return Opcode::MAX;
+	default:
+		if(f.unary != nullptr) {
+			return Opcode::CALL1;
+		}
+		if(f.binary != nullptr) {
+			return Opcode::CALL2;
+		}
+		return Opcode::CALL;
+	}
+}
+
+template <typename T>
+void Program<T>::compile(const FlatTree <T> &tree)
+{
+	typedef typename FlatTree<T>::Kind Kind;
+	m_code.clear();
+	m_max_depth = 0;
+	m_temps = 0;
+	if(tree.empty()) {
+		return;
+	}
+
+	// Number of references to each node. Tree may be a DAG with shared subtrees (see
+	// hashCons), each node referenced several times is evaluated once and then stored.
+	const auto &nodes = tree.nodes();
+	std::vector <uint32_t> refs(nodes.size(), 0);
+	for(auto i : tree.args()) {
+		++refs[i];
+	}
+
+	// Temporary slots of already evaluated shared nodes
+	const uint32_t no_slot = static_cast<uint32_t>(-1);
+	std::vector <uint32_t> slots(nodes.size(), no_slot);
+	// Each element is a node and the number of its already compiled arguments
+	std::vector <std::pair <uint32_t, uint32_t> > stack;
+	size_t depth = 0;
+	stack.push_back(std::make_pair(static_cast<uint32_t>(nodes.size() - 1), 0));
+	while(!stack.empty()) {
+		uint32_t id = stack.back().first;
+		uint32_t &arg = stack.back().second;
+		const auto &node = nodes[id];
+		if(arg < node.argsNum()) {
+			uint32_t c = tree.argsOf(node)[arg++];
+			if(slots[c] != no_slot) {
+				m_code.push_back(instruction(Opcode::LOAD, slots[c]));
+				m_max_depth = std::max(m_max_depth, ++depth);
+			} else {
+				stack.push_back(std::make_pair(c, 0));
+			}
+			continue;
+		}
+		stack.pop_back();
+		switch(node.kind()) {
+		case Kind::FUNCTION:
+		{
+			Instruction ins = instruction(Opcode::CALL, node.argsNum());
+			ins.func = &tree.function(node);
+			ins.op = opcode(*ins.func);
+			m_code.push_back(ins);
+			depth -= ins.arg;
+			break;
+		}
+		case Kind::VARIABLE:
+			m_code.push_back(instruction(Opcode::VARIABLE, node.data));
+			break;
+		case Kind::CONSTANT:
+		{
+			Instruction ins = instruction(Opcode::CONSTANT, 0);
+			ins.val = tree.constants()[node.data];
+			m_code.push_back(ins);
+			break;
+		}
+		}
+		m_max_depth = std::max(m_max_depth, ++depth);
+		if((refs[id] > 1) && (node.kind() == Kind::FUNCTION)) {
+			slots[id] = static_cast<uint32_t>(m_temps);
+			m_code.push_back(instruction(Opcode::STORE, m_temps++));
+		}
+	}
+	m_state.stack.resize(m_max_depth);
+}
+
+template <typename T>
+T Program<T>::eval(const T *vars, State &state) const
+{
+	state.stack.resize(m_max_depth);
+	state.temps.resize(m_temps);
+	T *sp = state.stack.data();
+	for(const auto &i : m_code) {
+		switch(i.op) {
+		case Opcode::CONSTANT:
+			*sp++ = i.val;
+			break;
+		case Opcode::VARIABLE:
+			*sp++ = vars[i.arg];
+			break;
+		case Opcode::LOAD:
+			*sp++ = state.temps[i.arg];
+			break;
+		case Opcode::STORE:
+			state.temps[i.arg] = sp[-1];
+			break;
+		case Opcode::ADD:
+			--sp;
+			sp[-1] = sp[-1] + sp[0];
+			break;
+		case Opcode::SUB:
+			--sp;
+			sp[-1] = sp[-1] - sp[0];
+			break;
+		case Opcode::MUL:
+			--sp;
+			sp[-1] = sp[-1] * sp[0];
+			break;
+		case Opcode::DIV:
+			--sp;
+			sp[-1] = sp[-1] / sp[0];
+			break;
+		case Opcode::NEG:
+			sp[-1] = -sp[-1];
+			break;
+		case Opcode::ABS:
+			sp[-1] = std::abs(sp[-1]);
+			break;
+		case Opcode::MIN:
+			--sp;
+			sp[-1] = std::min(sp[-1], sp[0]);
+			break;
+		case Opcode::MAX:
+			--sp;
+			sp[-1] = std::max(sp[-1], sp[0]);
+			break;
+		case Opcode::CALL:
+			sp -= i.arg;
+			state.args.assign(sp, sp + i.arg);
+			*sp++ = i.func->func(state.args);
+			break;
+		case Opcode::CALL1:
+			sp[-1] = i.func->unary(sp[-1]);
+			break;
+		case Opcode::CALL2:
+			--sp;
+			sp[-1] = i.func->binary(sp[-1], sp[0]);
+			break;
+		}
+	}
+	return state.stack[0];
+}
+
+template <typename T>
+void Program<T>::evalBatch(const T *const *columns, size_t begin, size_t end, T *out,
+                           State &state) const
+{
+	const size_t bs = block_size;
+	state.block_stack.resize(m_max_depth * bs);
+	state.temps.resize(m_temps * bs);
+	for(size_t base = begin; base < end; base += bs) {
+		size_t len = std::min(bs, end - base);
+		// Points to the first free block of the stack
+		T *sp = state.block_stack.data();
+		for(const auto &i : m_code) {
+			switch(i.op) {
+			case Opcode::CONSTANT:
+				std::fill(sp, sp + len, i.val);
+				sp += bs;
+				break;
+			case Opcode::VARIABLE:
+				std::copy(columns[i.arg] + base, columns[i.arg] + base + len, sp);
+				sp += bs;
+				break;
+			case Opcode::LOAD:
+				std::copy(&state.temps[i.arg * bs], &state.temps[i.arg * bs] + len, sp);
+				sp += bs;
+				break;
+			case Opcode::STORE:
+				std::copy(sp - bs, sp - bs + len, &state.temps[i.arg * bs]);
+				break;
+			case Opcode::ADD:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return a + b;});
+				break;
+			case Opcode::SUB:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return a - b;});
+				break;
+			case Opcode::MUL:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return a * b;});
+				break;
+			case Opcode::DIV:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return a / b;});
+				break;
+			case Opcode::NEG:
+				kernel(sp - bs, len, [](T a){return -a;});
+				break;
+			case Opcode::ABS:
+				kernel(sp - bs, len, [](T a){return std::abs(a);});
+				break;
+			case Opcode::MIN:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return std::min(a, b);});
+				break;
+			case Opcode::MAX:
+				sp -= bs;
+				kernel(sp - bs, sp, len, [](T a, T b){return std::max(a, b);});
+				break;
+			case Opcode::CALL:
+				sp -= i.arg * bs;
+				state.args.resize(i.arg);
+				for(size_t j = 0; j < len; ++j) {
+					for(size_t k = 0; k < i.arg; ++k) {
+						state.args[k] = sp[k * bs + j];
+					}
+					sp[j] = i.func->func(state.args);
+				}
+				sp += bs;
+				break;
+			case Opcode::CALL1:
+				kernel(sp - bs, len, i.func->unary);
+				break;
+			case Opcode::CALL2:
+				sp -= bs;
+				kernel(sp - bs, sp, len, i.func->binary);
+				break;
+			}
+		}
+		std::copy(state.block_stack.data(), state.block_stack.data() + len, out + base);
+	}
+}
+
+template <typename T>
+const size_t Program<T>::block_size;
+
+#endif
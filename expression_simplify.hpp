@@ -0,0 +1,174 @@
+#ifndef EXPRESSION_SIMPLIFY_H
+#define EXPRESSION_SIMPLIFY_H
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include "expression_base.hpp"
+#include "expression_cell.hpp"
+
+// Simplifies the tree in place and returns the number of removed cells:
+//  - function calls with constant arguments are replaced with their values,
+//  - x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1 are replaced with x,
+//  - double negation is removed,
+//  - arguments of commutative operators are put in canonical order (see Cell::sort).
+// All functions are assumed to be pure. Removed cells stay in the arena of the tree.
+template <typename T>
+size_t simplify(Cell <T> *root);
+
+namespace detail {
+template <typename T>
+bool isConstant(const Cell <T> *c, T val)
+{
+	return (c->type == Cell<T>::Type::CONSTANT) && (c->val == val);
+}
+
+// Turns cell into a copy of src. Arguments of src become arguments of cell.
+template <typename T>
+void replaceCell(Cell <T> *cell, const Cell <T> *src)
+{
+	cell->type = src->type;
+	cell->func.iter = src->func.iter;
+	cell->func.args = src->func.args;
+	cell->var.name = src->var.name;
+	cell->var.id = src->var.id;
+	cell->val = src->val;
+}
+}
+
+template <typename T>
+size_t simplify(Cell <T> *root)
+{
+	typedef typename Function<T>::Builtin Builtin;
+	const T zero = T(0), one = T(1);
+	size_t removed = 0;
+	Args <T> args;
+	// Arguments are visited before the function, so they are already simplified. Shared
+	// cells are simplified once.
+	for(auto cell : root->distinctCells()) {
+		if(cell->type != Cell<T>::Type::FUNCTION) {
+			continue;
+		}
+		const Function <T> &f = *cell->func.iter;
+		const std::vector <Cell <T>*> &a = cell->func.args;
+		bool constant = true;
+		for(auto i : a) {
+			constant &= (i->type == Cell<T>::Type::CONSTANT);
+		}
+		if(constant && !((f.builtin == Builtin::DIV) && (a[1]->val == zero))) {
+			args.clear();
+			for(auto i : a) {
+				args.push_back(i->val);
+			}
+			removed += a.size();
+			cell->val = f.func(args);
+			cell->type = Cell<T>::Type::CONSTANT;
+			cell->func.args.clear();
+			continue;
+		}
+		const Cell <T> *res = nullptr;
+		if(((f.builtin == Builtin::ADD) && detail::isConstant(a[1], zero))
+		   || ((f.builtin == Builtin::SUB) && detail::isConstant(a[1], zero))
+		   || ((f.builtin == Builtin::MUL) && detail::isConstant(a[1], one))
+		   || ((f.builtin == Builtin::DIV) && detail::isConstant(a[1], one))) {
+			res = a[0];
+		} else if(((f.builtin == Builtin::ADD) && detail::isConstant(a[0], zero))
+		          || ((f.builtin == Builtin::MUL) && detail::isConstant(a[0], one))) {
+			res = a[1];
+		} else if((f.builtin == Builtin::NEG) && (a[0]->type == Cell<T>::Type::FUNCTION)
+		          && (a[0]->func.iter->builtin == Builtin::NEG)) {
+			res = a[0]->func.args[0];
+		}
+		if(res != nullptr) {
+			removed += 2;
+			detail::replaceCell(cell, res);
+		}
+	}
+	// Also updates hashes
+	root->sort();
+	return removed;
+}
+
+// Makes structurally equal subtrees share one cell, so the tree becomes a DAG.
+// Compiled programs evaluate every shared cell only once. Returns the number of cells that
+// are no longer referenced (they stay in the arena of the tree).
+template <typename T>
+size_t hashCons(Cell <T> *root);
+
+namespace detail {
+// Hash and equality of cells which assume that equal arguments are the same cells
+template <typename T>
+struct ShallowCellHash
+{
+	size_t operator()(const Cell <T> *c) const
+	{
+		// Structural hash of the cell differs only for equal cells with different
+		// arguments, so it's a good start
+		size_t res = c->hash;
+		if(c->type == Cell<T>::Type::FUNCTION) {
+			for(auto i : c->func.args) {
+				hashCombine(res, std::hash <const void*>()(i));
+			}
+		}
+		return res;
+	}
+};
+
+template <typename T>
+struct ShallowCellEqual
+{
+	bool operator()(const Cell <T> *a, const Cell <T> *b) const
+	{
+		if(a->type != b->type) {
+			return false;
+		}
+		switch(a->type) {
+		case Cell<T>::Type::FUNCTION:
+			return (a->func.iter == b->func.iter) && (a->func.args == b->func.args);
+		case Cell<T>::Type::VARIABLE:
+			return a->var.name == b->var.name;
+		case Cell<T>::Type::CONSTANT:
+			return a->val == b->val;
+		default:
+			return false;
+		}
+	}
+};
+}
+
+template <typename T>
+size_t hashCons(Cell <T> *root)
+{
+	std::unordered_set <Cell <T>*, detail::ShallowCellHash <T>, detail::ShallowCellEqual <T> > cells;
+	// Shared cell for each cell that has already been processed
+	std::unordered_map <const Cell <T>*, Cell <T>*> canonical;
+	// Each element is a cell and the number of its already processed arguments
+	std::vector <std::pair <Cell <T>*, size_t> > stack;
+	size_t removed = 0;
+	stack.push_back(std::make_pair(root, 0));
+	while(!stack.empty()) {
+		Cell <T> *cell = stack.back().first;
+		size_t &arg = stack.back().second;
+		if((cell->type == Cell<T>::Type::FUNCTION) && (arg < cell->func.args.size())) {
+			Cell <T> *c = cell->func.args[arg++];
+			if(canonical.find(c) == canonical.end()) {
+				stack.push_back(std::make_pair(c, 0));
+			}
+			continue;
+		}
+		stack.pop_back();
+		if(cell->type == Cell<T>::Type::FUNCTION) {
+			for(auto &i : cell->func.args) {
+				i = canonical[i];
+			}
+		}
+		auto res = cells.insert(cell);
+		if(!res.second) {
+			++removed;
+		}
+		canonical[cell] = *res.first;
+	}
+	return removed;
+}
+
+#endif
@@ -1,4 +1,7 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <functional>
 
@@ -20,13 +23,36 @@ void testSpeed()
 	Expression e1(s);
 }
 
-int main()
+// Parses every line of the file as a separate expression and reports malformed lines
+int parseBulk(const string &path, size_t threads)
+{
+	ThreadPool pool(threads);
+	vector <Expression::LineError> errors;
+	auto begin = chrono::steady_clock::now();
+	auto exprs = Expression::parseFile(path, pool, errors);
+	auto end = chrono::steady_clock::now();
+	for(const auto &i : errors) {
+		cerr << path << ":" << i.line + 1 << ":" << i.error.offset + 1 << ": " << i.error.message() << endl;
+	}
+	cout << "Parsed " << exprs.size() << " lines (" << errors.size() << " with errors) in "
+	     << chrono::duration<double, milli>(end - begin).count() << " ms using "
+	     << pool.size() << " threads" << endl;
+	return errors.empty() ? 0 : 2;
+}
+
+int main(int argc, char **argv)
 {
 	try {
+		if((argc >= 3) && (string(argv[1]) == "--bulk")) {
+			return parseBulk(argv[2], (argc >= 4) ? strtoul(argv[3], nullptr, 10) : 0);
+		}
 //		testSpeed();
 		string s;
 		getline(cin, s);
 		Expression e1(s);
+		cout << "You entered: " << endl;
+		e1.print();
+		cout << endl;
 	} catch(std::exception &e) {
 		cout << e.what() << endl;
 	}
@@ -0,0 +1,122 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) :
+	m_queued(0),
+	m_pending(0),
+	m_stop(false)
+{
+	if(threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for(size_t i = 0; i < threads; ++i) {
+		m_queues.emplace_back(new Queue());
+	}
+	for(size_t i = 0; i + 1 < threads; ++i) {
+		m_threads.emplace_back(&ThreadPool::worker, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard <std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	for(auto &i : m_threads) {
+		i.join();
+	}
+}
+
+size_t ThreadPool::size() const
+{
+	return m_queues.size();
+}
+
+void ThreadPool::run(const std::vector <Task> &tasks)
+{
+	if(tasks.empty()) {
+		return;
+	}
+	std::lock_guard <std::mutex> run_lock(m_run_mutex);
+	m_error = nullptr;
+	m_pending = tasks.size();
+	{
+		std::lock_guard <std::mutex> lock(m_mutex);
+		m_queued += tasks.size();
+	}
+	// Contiguous ranges of tasks go to the same queue, so neighbouring tasks are usually
+	// executed by the same thread
+	size_t per_queue = (tasks.size() + m_queues.size() - 1) / m_queues.size();
+	for(size_t q = 0; q < m_queues.size(); ++q) {
+		std::lock_guard <std::mutex> lock(m_queues[q]->mutex);
+		for(size_t i = q * per_queue; (i < (q + 1) * per_queue) && (i < tasks.size()); ++i) {
+			m_queues[q]->tasks.push_back(&tasks[i]);
+		}
+	}
+	m_cv.notify_all();
+
+	const Task *task;
+	while(pop(m_queues.size() - 1, task)) {
+		execute(*task);
+	}
+	std::unique_lock <std::mutex> lock(m_mutex);
+	m_done_cv.wait(lock, [this]{return m_pending == 0;});
+	if(m_error) {
+		std::rethrow_exception(m_error);
+	}
+}
+
+void ThreadPool::worker(size_t id)
+{
+	for(;;) {
+		const Task *task;
+		if(pop(id, task)) {
+			execute(*task);
+			continue;
+		}
+		std::unique_lock <std::mutex> lock(m_mutex);
+		m_cv.wait(lock, [this]{return m_stop || (m_queued > 0);});
+		if(m_stop) {
+			return;
+		}
+	}
+}
+
+bool ThreadPool::pop(size_t id, const Task *&task)
+{
+	for(size_t i = 0; i < m_queues.size(); ++i) {
+		Queue &q = *m_queues[(id + i) % m_queues.size()];
+		std::lock_guard <std::mutex> lock(q.mutex);
+		if(!q.tasks.empty()) {
+			if(i == 0) {
+				task = q.tasks.front();
+				q.tasks.pop_front();
+			} else {
+				task = q.tasks.back();
+				q.tasks.pop_back();
+			}
+			--m_queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::execute(const Task &task)
+{
+	try {
+		task();
+	} catch(...) {
+		std::lock_guard <std::mutex> lock(m_mutex);
+		if(!m_error) {
+			m_error = std::current_exception();
+		}
+	}
+	if(--m_pending == 0) {
+		std::lock_guard <std::mutex> lock(m_mutex);
+		m_done_cv.notify_all();
+	}
+}
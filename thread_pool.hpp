@@ -0,0 +1,67 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Tasks of each run() are spread over per-thread queues;
+// a thread takes tasks from the front of its own queue and, when it's empty, steals
+// from the back of the queues of other threads.
+class ThreadPool
+{
+public:
+	typedef std::function <void()> Task;
+
+	// threads is the number of threads executing tasks including the one calling run(), so
+	// threads - 1 workers are created. Zero means number of hardware threads.
+	explicit ThreadPool(size_t threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Number of threads executing tasks, including the thread calling run()
+	size_t size() const;
+
+	// Executes all tasks and returns when all of them are finished. The calling thread takes
+	// part in execution. If some task throws, the first exception is rethrown after all tasks
+	// are finished.
+	void run(const std::vector <Task> &tasks);
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque <const Task*> tasks;
+	};
+
+	void worker(size_t id);
+	// Takes next task for the thread id, returns false if all queues are empty
+	bool pop(size_t id, const Task *&task);
+	void execute(const Task &task);
+
+	// One queue for each worker and the last one for the thread calling run()
+	std::vector <std::unique_ptr <Queue> > m_queues;
+	std::vector <std::thread> m_threads;
+
+	// Serializes calls of run()
+	std::mutex m_run_mutex;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::condition_variable m_done_cv;
+	// Number of tasks in queues
+	std::atomic <size_t> m_queued;
+	// Number of tasks of current run() that aren't finished yet
+	std::atomic <size_t> m_pending;
+	std::exception_ptr m_error;
+	bool m_stop;
+};
+
+#endif